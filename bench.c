@@ -0,0 +1,260 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+#define STR_LEN 11
+#define DEFAULT_ITERATIONS 100000
+
+typedef struct {
+  int32_t player_id;
+  float value;
+  char type[STR_LEN];
+  float player_profit;
+  float house_profit;
+} aviator_msg;
+
+// Interface comum aos transportes comparados: cada lado tem um contexto
+// próprio e o benchmark faz ping-pong de uma aviator_msg
+typedef struct {
+  ssize_t (*send)(void *ctx, const void *buf, size_t len);
+  ssize_t (*recv)(void *ctx, void *buf, size_t len);
+} bench_transport;
+
+typedef struct {
+  shm_ring *tx;
+  shm_ring *rx;
+} shm_endpoint;
+
+// Hoisting de funções
+void endWithErrorMessage(const char *message);
+ssize_t socket_send(void *ctx, const void *buf, size_t len);
+ssize_t socket_recv(void *ctx, void *buf, size_t len);
+ssize_t ring_send(void *ctx, const void *buf, size_t len);
+ssize_t ring_recv(void *ctx, void *buf, size_t len);
+int recv_full(const bench_transport *transport, void *ctx, void *buf,
+              size_t len);
+void echo_loop(const bench_transport *transport, void *ctx, int iterations);
+void ping_loop(const bench_transport *transport, void *ctx, int iterations);
+void bench_tcp(int iterations);
+void bench_unix(int iterations);
+void bench_shm(int iterations);
+int compare_u64(const void *a, const void *b);
+uint64_t now_ns();
+
+const bench_transport socket_transport = {socket_send, socket_recv};
+const bench_transport ring_transport = {ring_send, ring_recv};
+
+int main(int argc, char *argv[]) {
+  int iterations = DEFAULT_ITERATIONS;
+
+  // Uso: ./bin/transport_bench [iterações]
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+      endWithErrorMessage("Invalid number of iterations");
+    }
+  }
+
+  printf("%-12s %12s %10s %10s %10s %12s\n", "transport", "iterations",
+         "avg(us)", "p50(us)", "p99(us)", "msgs/s");
+  fflush(stdout);
+  bench_tcp(iterations);
+  bench_unix(iterations);
+  bench_shm(iterations);
+
+  return EXIT_SUCCESS;
+}
+
+// Transporte por socket (TCP ou Unix), o contexto é o descritor
+ssize_t socket_send(void *ctx, const void *buf, size_t len) {
+  return send(*(int *)ctx, buf, len, 0);
+}
+
+ssize_t socket_recv(void *ctx, void *buf, size_t len) {
+  return recv(*(int *)ctx, buf, len, 0);
+}
+
+// Transporte por anel em memória compartilhada
+ssize_t ring_send(void *ctx, const void *buf, size_t len) {
+  return shm_ring_write(((shm_endpoint *)ctx)->tx, buf, len, 1);
+}
+
+ssize_t ring_recv(void *ctx, void *buf, size_t len) {
+  return shm_ring_read(((shm_endpoint *)ctx)->rx, buf, len, -1);
+}
+
+// Função para receber exatamente len bytes
+int recv_full(const bench_transport *transport, void *ctx, void *buf,
+              size_t len) {
+  size_t received = 0;
+  while (received < len) {
+    ssize_t n =
+        transport->recv(ctx, (unsigned char *)buf + received, len - received);
+    if (n <= 0) {
+      return 0;
+    }
+    received += n;
+  }
+  return 1;
+}
+
+// Lado que devolve cada mensagem recebida
+void echo_loop(const bench_transport *transport, void *ctx, int iterations) {
+  aviator_msg message;
+  for (int i = 0; i < iterations; i++) {
+    if (!recv_full(transport, ctx, &message, sizeof(aviator_msg))) {
+      break;
+    }
+    transport->send(ctx, &message, sizeof(aviator_msg));
+  }
+}
+
+// Lado que mede o tempo de ida e volta de cada mensagem
+void ping_loop(const bench_transport *transport, void *ctx, int iterations) {
+  aviator_msg message;
+  uint64_t *samples = malloc(sizeof(uint64_t) * iterations);
+  uint64_t total = 0;
+
+  memset(&message, 0, sizeof(aviator_msg));
+  strcpy(message.type, "multiplier");
+
+  uint64_t started = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    uint64_t sent_at = now_ns();
+    message.value = i;
+    transport->send(ctx, &message, sizeof(aviator_msg));
+    if (!recv_full(transport, ctx, &message, sizeof(aviator_msg))) {
+      endWithErrorMessage("Echo side closed the connection");
+    }
+    samples[i] = now_ns() - sent_at;
+    total += samples[i];
+  }
+  uint64_t elapsed = now_ns() - started;
+
+  qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+  printf("%12d %10.2f %10.2f %10.2f %12.0f\n", iterations,
+         total / (double)iterations / 1000.0, samples[iterations / 2] / 1000.0,
+         samples[(int)(iterations * 0.99)] / 1000.0,
+         iterations / (elapsed / 1e9));
+  fflush(stdout);
+  free(samples);
+}
+
+// TCP pelo loopback, como os clientes conectam hoje
+void bench_tcp(int iterations) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  int nodelay = 1;
+
+  int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_socket, 1) < 0) {
+    endWithErrorMessage("Error preparing the tcp socket");
+  }
+  getsockname(listen_socket, (struct sockaddr *)&addr, &addr_len);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int conn = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      endWithErrorMessage("Error connecting to the tcp socket");
+    }
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    echo_loop(&socket_transport, &conn, iterations);
+    exit(0);
+  }
+
+  int conn = accept(listen_socket, NULL, NULL);
+  setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  printf("%-12s ", "tcp");
+  ping_loop(&socket_transport, &conn, iterations);
+
+  close(conn);
+  close(listen_socket);
+  waitpid(pid, NULL, 0);
+}
+
+// Socket Unix, a alternativa local sem memória compartilhada
+void bench_unix(int iterations) {
+  int pair[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+    endWithErrorMessage("Error creating unix socket pair");
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(pair[0]);
+    echo_loop(&socket_transport, &pair[1], iterations);
+    exit(0);
+  }
+
+  close(pair[1]);
+  printf("%-12s ", "unix");
+  ping_loop(&socket_transport, &pair[0], iterations);
+
+  close(pair[0]);
+  waitpid(pid, NULL, 0);
+}
+
+// Anéis SPSC do shm_ring.h, o mesmo layout de sessão usado pelo servidor
+void bench_shm(int iterations) {
+  shm_session *session =
+      mmap(NULL, sizeof(shm_session), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (session == MAP_FAILED) {
+    endWithErrorMessage("Error mapping the shared memory session");
+  }
+  shm_ring_init(&session->to_client);
+  shm_ring_init(&session->to_server);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm_endpoint echo = {&session->to_client, &session->to_server};
+    echo_loop(&ring_transport, &echo, iterations);
+    exit(0);
+  }
+
+  shm_endpoint ping = {&session->to_server, &session->to_client};
+  printf("%-12s ", "shm");
+  ping_loop(&ring_transport, &ping, iterations);
+
+  waitpid(pid, NULL, 0);
+  munmap(session, sizeof(shm_session));
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Função para obter o tempo monotônico em nanossegundos
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Função para exibir erros genéricos e finalizar a execução do programa sem
+// tratamentos
+void endWithErrorMessage(const char *message) {
+  perror(message);
+  exit(EXIT_FAILURE);
+}
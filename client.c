@@ -1,25 +1,63 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "shm_ring.h"
+
 #define STR_LEN 11
 #define MAX_NICKNAME 13
 #define MAX_LEN 256
+#define HEARTBEAT_INTERVAL_S 20
+#define HISTORY_PAGE 10
+#define HISTORY_PAGE_MAX 20
+
+typedef struct {
+  int32_t player_id;
+  float value;
+  char type[STR_LEN];
+  float player_profit;
+  float house_profit;
+} aviator_msg;
+
+// Resultado de uma rodada no histórico enviado pelo servidor
+typedef struct {
+  uint32_t round_id;
+  int32_t players;
+  float explosion;
+  float total_staked;
+  float house_delta;
+} history_entry;
 
 // Hoisting de funções
 void endWithErrorMessage(const char *message);
 void shutdown_client();
+void request_shutdown(int signal);
 void *handle_input();
 int validate_bet_input(const char *input, float *bet_value);
+void connect_tcp(char *server_IP, char *server_port);
+void connect_shm(const char *path);
+ssize_t client_send(const void *buf, size_t len);
+ssize_t client_recv(void *buf, size_t len);
+int recv_message(aviator_msg *message);
+int recv_full(void *buf, size_t len);
+void *handle_heartbeat();
+
+// Níveis de assinatura do fluxo do multiplicador, na mesma ordem do servidor
+const char *tier_names[] = {"full", "reduced", "milestones", "rounds"};
 
 // ENUM para fazer o tracking do estato do jogo
 typedef enum {
@@ -31,36 +69,30 @@ typedef enum {
 // Variáveis globais para acompanhamento de estados
 char nickname[MAX_NICKNAME];
 int client_running = 1;
+volatile sig_atomic_t interrupted = 0;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
 int client_socket;
 int current_game_phase = WAIT;
 int has_bet_this_round = 0;
 float current_bet = 0;
 int has_received_start = 0;
 int has_cashedout_this_round = 0;
-
-typedef struct {
-  int32_t player_id;
-  float value;
-  char type[STR_LEN];
-  float player_profit;
-  float house_profit;
-} aviator_msg;
+shm_session *local_session = NULL;
+uint32_t oldest_round_seen = 0;
 
 int main(int argc, char *argv[]) {
-  struct sockaddr_in client_addr_ipv4;
-  struct sockaddr_in6 client_addr_ipv6;
-  struct addrinfo criteria;
-  struct addrinfo *response;
   pthread_t input_thread;
+  pthread_t heartbeat_thread;
 
   char *server_IP = argv[1];
   char *server_port = argv[2];
-  int is_IPv4 = 0;
-  int stop_game = 1;
+  int tier = 0;
   aviator_msg aviator_message;
+  struct sigaction interrupt;
+  sigset_t blocked;
 
   // Checagens para inicio do cliente
-  if (argc != 5) {
+  if (argc != 5 && argc != 7) {
     endWithErrorMessage("Error: Invalid number of arguments");
   }
 
@@ -74,102 +106,71 @@ int main(int argc, char *argv[]) {
 
   strcpy(nickname, argv[4]);
 
-  signal(SIGINT, shutdown_client);
-
-  // Comparando o argumento de versão do protocolo para definir qual tipo foi
-  // selecionado
-  memset(&criteria, 0, sizeof(criteria));
-  criteria.ai_family = AF_UNSPEC;
-  criteria.ai_socktype = SOCK_STREAM;
-
-  // Resolve seguindo a versão de acordo com o IP e a porta, juntamente com um
-  // modelo de resposta
-  int err = getaddrinfo(server_IP, server_port, &criteria, &response);
-  if (err < 0) {
-    endWithErrorMessage("Error trying to identify the IP protocol");
-  }
-
-  if (response->ai_family == AF_INET) {
-    is_IPv4 = 1;
-  } else if (response->ai_family == AF_INET6) {
-    is_IPv4 = 0;
-  }
-
-  if (is_IPv4 == 1) {
-    // Conectando ao servidor - Um loop infinito ate que a conexão com o
-    // servidor seja aceita
-    while (1) {
-      // Socket IPv4
-      memset(&client_addr_ipv4, 0, sizeof(client_addr_ipv4));
-      client_addr_ipv4.sin_family = AF_INET;
-      client_addr_ipv4.sin_port = htons(atoi(argv[2]));
-
-      // Criando socket
-      client_socket = socket(client_addr_ipv4.sin_family, SOCK_STREAM, 0);
-      if (client_socket < 0) {
-        endWithErrorMessage("Error creating ipv4 socket");
-      }
-
-      // Utilizando biblioteca para convertar IP para binário
-      int checkBinaryIP;
-      checkBinaryIP = inet_pton(AF_INET, argv[1], &client_addr_ipv4.sin_addr);
-      if (checkBinaryIP <= 0) {
-        endWithErrorMessage("Invalid address");
-      }
-
-      int checkConnection;
-      checkConnection =
-          connect(client_socket, (struct sockaddr *)&client_addr_ipv4,
-                  sizeof(client_addr_ipv4));
-      if (checkConnection >= 0) {
-        break;
-      } else {
-        close(client_socket);
+  // Nível de assinatura opcional: -tier full|reduced|milestones|rounds
+  if (argc == 7) {
+    if (strcmp(argv[5], "-tier") != 0) {
+      endWithErrorMessage("Error: Expected '-tier' argument");
+    }
+    tier = -1;
+    for (int i = 0; i < 4; i++) {
+      if (strcmp(argv[6], tier_names[i]) == 0) {
+        tier = i;
       }
     }
+    if (tier < 0) {
+      endWithErrorMessage("Error: Invalid tier (full, reduced, milestones, "
+                          "rounds)");
+    }
+  }
 
+  // O handler só marca o pedido de saída; o encerramento é feito pela thread
+  // principal. Sem SA_RESTART, a espera por mensagens é interrompida
+  memset(&interrupt, 0, sizeof(interrupt));
+  interrupt.sa_handler = request_shutdown;
+  sigemptyset(&interrupt.sa_mask);
+  sigaction(SIGINT, &interrupt, NULL);
+
+  // O cliente pode se conectar por TCP ou, quando está na mesma máquina do
+  // servidor, por memória compartilhada: ./bin/client shm <socket> -nick x
+  if (strcmp(server_IP, "shm") == 0) {
+    connect_shm(server_port);
   } else {
-    // Conectando ao servidor - Um loop infinito ate que a conexão com o
-    // servidor seja aceita
-    while (1) {
-      // Socket IPv6
-      memset(&client_addr_ipv6, 0, sizeof(client_addr_ipv6));
-      client_addr_ipv6.sin6_family = AF_INET6;
-      client_addr_ipv6.sin6_port = htons(atoi(argv[2]));
-
-      client_socket = socket(client_addr_ipv6.sin6_family, SOCK_STREAM, 0);
-      if (client_socket < 0) {
-        endWithErrorMessage("Error creating ipv4 socket");
-      }
-
-      // Utilizando biblioteca para convertar IP para binário
-      int checkBinaryIP;
-      checkBinaryIP = inet_pton(AF_INET6, argv[1], &client_addr_ipv6.sin6_addr);
-      if (checkBinaryIP <= 0) {
-        endWithErrorMessage("Invalid address");
-      }
+    connect_tcp(server_IP, server_port);
+  }
 
-      // Conectando ao servidor - Um loop infinito ate que a conexao seja
-      // aceita
-      int checkConnection;
-      checkConnection =
-          connect(client_socket, (struct sockaddr *)&client_addr_ipv6,
-                  sizeof(client_addr_ipv6));
-      if (checkConnection == 0) {
-        break;
-      } else {
-        close(client_socket);
-      }
-    }
+  // Sem assinatura o servidor envia todos os ticks
+  if (tier != 0) {
+    memset(&aviator_message, 0, sizeof(aviator_msg));
+    strcpy(aviator_message.type, "subscribe");
+    aviator_message.value = tier;
+    client_send(&aviator_message, sizeof(aviator_msg));
   }
 
+  // As demais threads herdam o SIGINT bloqueado, garantindo que ele chegue
+  // à thread principal
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
   // Thread para lidar com os inputs de maneira separada a execução do jogo
   pthread_create(&input_thread, NULL, handle_input, NULL);
 
+  // Thread para avisar ao servidor que o cliente segue vivo mesmo sem apostar
+  pthread_create(&heartbeat_thread, NULL, handle_heartbeat, NULL);
+
+  pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+
   // Loop sem fim de execução do jogo
   while (client_running) {
     // Esperando contato do servidor
-    recv(client_socket, &aviator_message, sizeof(aviator_msg), 0);
+    if (!recv_message(&aviator_message)) {
+      if (interrupted) {
+        shutdown_client();
+      }
+      printf("Conexão com o servidor perdida. Até breve!\n");
+      client_running = 0;
+      break;
+    }
 
     // Cláusula para processar os diferentes tipos de evetos que podem ser
     // enviados pelo servidor ao cliente
@@ -228,6 +229,43 @@ int main(int argc, char *argv[]) {
         }
       }
       fflush(stdout);
+    } else if (strcmp(aviator_message.type, "history") == 0) {
+      // Lote do histórico: o cabeçalho traz a quantidade de rodadas
+      history_entry entries[HISTORY_PAGE_MAX];
+      int count = aviator_message.player_id;
+      if (count < 0 || count > HISTORY_PAGE_MAX ||
+          !recv_full(entries, count * sizeof(history_entry))) {
+        printf("Conexão com o servidor perdida. Até breve!\n");
+        client_running = 0;
+        break;
+      }
+
+      if (count == 0) {
+        printf("Sem rodadas anteriores no histórico.\n");
+      } else {
+        printf("Histórico de rodadas ([H] para ver mais antigas):\n");
+        oldest_round_seen = entries[count - 1].round_id;
+      }
+      for (int i = 0; i < count; i++) {
+        printf("  Rodada %u: %.2fx | %d jogadores | R$ %.2f apostados | "
+               "casa %+.2f\n",
+               entries[i].round_id, entries[i].explosion, entries[i].players,
+               entries[i].total_staked, entries[i].house_delta);
+      }
+      fflush(stdout);
+    } else if (strcmp(aviator_message.type, "top") == 0) {
+      // Top-K do ranking enviado ao fim de cada rodada
+      if (aviator_message.value == 1) {
+        printf("Ranking da rodada:\n");
+      }
+      printf("  %.0fº jogador %d: R$ %.2f\n", aviator_message.value,
+             aviator_message.player_id, aviator_message.player_profit);
+      fflush(stdout);
+    } else if (strcmp(aviator_message.type, "rank") == 0) {
+      printf("Sua posição no ranking: %.0fº (jogador %d, R$ %.2f)\n",
+             aviator_message.value, aviator_message.player_id,
+             aviator_message.player_profit);
+      fflush(stdout);
     } else if (strcmp(aviator_message.type, "bye") == 0) {
       printf("O servidor caiu, mas sua esperança pode continuar de pé. Até "
              "breve!\n");
@@ -264,7 +302,7 @@ void *handle_input() {
       // Comando de sair do jogo case insensitive
       memset(&aviator_message, 0, sizeof(aviator_msg));
       strcpy(aviator_message.type, "bye");
-      send(client_socket, &aviator_message, sizeof(aviator_msg), 0);
+      client_send(&aviator_message, sizeof(aviator_msg));
 
       printf("Aposte com responsabilidade. A plataforma é nova e tá com "
              "horário bugado. Volte logo, %s.\n",
@@ -277,16 +315,35 @@ void *handle_input() {
       if (current_game_phase == FlIGHT && has_bet_this_round) {
         memset(&aviator_message, 0, sizeof(aviator_msg));
         strcpy(aviator_message.type, "cashout");
-        send(client_socket, &aviator_message, sizeof(aviator_msg), 0);
+        client_send(&aviator_message, sizeof(aviator_msg));
+      }
+
+    } else if (strcmp(input, "H") == 0 || strcmp(input, "h") == 0) {
+      // Comando de paginar o histórico para trás case insensitive
+      if (oldest_round_seen > 1) {
+        memset(&aviator_message, 0, sizeof(aviator_msg));
+        strcpy(aviator_message.type, "history");
+        aviator_message.player_id = oldest_round_seen;
+        aviator_message.value = HISTORY_PAGE;
+        client_send(&aviator_message, sizeof(aviator_msg));
+      } else {
+        printf("Sem rodadas mais antigas no histórico.\n");
+        fflush(stdout);
       }
 
+    } else if (strcmp(input, "R") == 0 || strcmp(input, "r") == 0) {
+      // Comando de consultar a posição no ranking case insensitive
+      memset(&aviator_message, 0, sizeof(aviator_msg));
+      strcpy(aviator_message.type, "rank");
+      client_send(&aviator_message, sizeof(aviator_msg));
+
     } else if (current_game_phase == BET && !has_bet_this_round) {
       // Computar input de uma possível aposta realizada
       if (validate_bet_input(input, &bet_value)) {
         memset(&aviator_message, 0, sizeof(aviator_msg));
         strcpy(aviator_message.type, "bet");
         aviator_message.value = bet_value;
-        send(client_socket, &aviator_message, sizeof(aviator_msg), 0);
+        client_send(&aviator_message, sizeof(aviator_msg));
 
         current_bet = bet_value;
         has_bet_this_round = 1;
@@ -308,6 +365,10 @@ void *handle_input() {
 
 // Função para indicar o servidor que o cliente não irá mais jogar
 // aviator_msg message;
+// Handler do SIGINT: apenas marca o pedido, pois enviar o bye aqui poderia
+// concorrer com outra thread escrevendo no transporte
+void request_shutdown(int signal) { interrupted = 1; }
+
 void shutdown_client() {
   aviator_msg aviator_message;
   printf("\nAposte com responsabilidade. A plataforma é nova e tá com horário "
@@ -316,7 +377,7 @@ void shutdown_client() {
 
   memset(&aviator_message, 0, sizeof(aviator_msg));
   strcpy(aviator_message.type, "bye");
-  send(client_socket, &aviator_message, sizeof(aviator_msg), 0);
+  client_send(&aviator_message, sizeof(aviator_msg));
 
   client_running = 0;
   close(client_socket);
@@ -341,3 +402,237 @@ int validate_bet_input(const char *input, float *bet_value) {
   *bet_value = value;
   return 1; // Formato válido
 }
+
+// Função para conectar ao servidor via TCP, IPv4 ou IPv6 de acordo com o
+// endereço informado
+void connect_tcp(char *server_IP, char *server_port) {
+  struct sockaddr_in client_addr_ipv4;
+  struct sockaddr_in6 client_addr_ipv6;
+  struct addrinfo criteria;
+  struct addrinfo *response;
+  int is_IPv4 = 0;
+
+  // Comparando o argumento de versão do protocolo para definir qual tipo foi
+  // selecionado
+  memset(&criteria, 0, sizeof(criteria));
+  criteria.ai_family = AF_UNSPEC;
+  criteria.ai_socktype = SOCK_STREAM;
+
+  // Resolve seguindo a versão de acordo com o IP e a porta, juntamente com um
+  // modelo de resposta
+  int err = getaddrinfo(server_IP, server_port, &criteria, &response);
+  if (err < 0) {
+    endWithErrorMessage("Error trying to identify the IP protocol");
+  }
+
+  if (response->ai_family == AF_INET) {
+    is_IPv4 = 1;
+  } else if (response->ai_family == AF_INET6) {
+    is_IPv4 = 0;
+  }
+
+  if (is_IPv4 == 1) {
+    // Conectando ao servidor - Um loop infinito ate que a conexão com o
+    // servidor seja aceita
+    while (1) {
+      // Socket IPv4
+      memset(&client_addr_ipv4, 0, sizeof(client_addr_ipv4));
+      client_addr_ipv4.sin_family = AF_INET;
+      client_addr_ipv4.sin_port = htons(atoi(server_port));
+
+      // Criando socket
+      client_socket = socket(client_addr_ipv4.sin_family, SOCK_STREAM, 0);
+      if (client_socket < 0) {
+        endWithErrorMessage("Error creating ipv4 socket");
+      }
+
+      // Utilizando biblioteca para convertar IP para binário
+      int checkBinaryIP;
+      checkBinaryIP = inet_pton(AF_INET, server_IP, &client_addr_ipv4.sin_addr);
+      if (checkBinaryIP <= 0) {
+        endWithErrorMessage("Invalid address");
+      }
+
+      int checkConnection;
+      checkConnection =
+          connect(client_socket, (struct sockaddr *)&client_addr_ipv4,
+                  sizeof(client_addr_ipv4));
+      if (checkConnection >= 0) {
+        break;
+      } else {
+        close(client_socket);
+      }
+    }
+
+  } else {
+    // Conectando ao servidor - Um loop infinito ate que a conexão com o
+    // servidor seja aceita
+    while (1) {
+      // Socket IPv6
+      memset(&client_addr_ipv6, 0, sizeof(client_addr_ipv6));
+      client_addr_ipv6.sin6_family = AF_INET6;
+      client_addr_ipv6.sin6_port = htons(atoi(server_port));
+
+      client_socket = socket(client_addr_ipv6.sin6_family, SOCK_STREAM, 0);
+      if (client_socket < 0) {
+        endWithErrorMessage("Error creating ipv4 socket");
+      }
+
+      // Utilizando biblioteca para convertar IP para binário
+      int checkBinaryIP;
+      checkBinaryIP = inet_pton(AF_INET6, server_IP, &client_addr_ipv6.sin6_addr);
+      if (checkBinaryIP <= 0) {
+        endWithErrorMessage("Invalid address");
+      }
+
+      // Conectando ao servidor - Um loop infinito ate que a conexao seja
+      // aceita
+      int checkConnection;
+      checkConnection =
+          connect(client_socket, (struct sockaddr *)&client_addr_ipv6,
+                  sizeof(client_addr_ipv6));
+      if (checkConnection == 0) {
+        break;
+      } else {
+        close(client_socket);
+      }
+    }
+  }
+}
+
+// Função para conectar ao servidor pelo socket Unix de handshake e mapear o
+// segmento de memória compartilhada recebido
+void connect_shm(const char *path) {
+  struct sockaddr_un addr;
+  char payload;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {&payload, 1};
+  struct msghdr msg;
+  int memfd;
+
+  client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (client_socket < 0) {
+    endWithErrorMessage("Error creating unix socket");
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(client_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    endWithErrorMessage("Error connecting to the shared memory socket");
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(client_socket, &msg, 0) <= 0) {
+    endWithErrorMessage("Error receiving the shared memory session");
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+    endWithErrorMessage("Invalid shared memory session");
+  }
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+  local_session = mmap(NULL, sizeof(shm_session), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (local_session == MAP_FAILED) {
+    endWithErrorMessage("Error mapping the shared memory session");
+  }
+}
+
+// Funções de envio e recebimento independentes do transporte utilizado
+ssize_t client_send(const void *buf, size_t len) {
+  ssize_t sent;
+
+  // Entrada, heartbeat e encerramento enviam de threads diferentes, e o anel
+  // da memória compartilhada aceita um único produtor
+  pthread_mutex_lock(&send_lock);
+  if (local_session != NULL) {
+    // Com o anel cheio a espera é limitada, e o socket do handshake indica
+    // se o servidor caiu em vez de esperar para sempre
+    shm_ring *ring = &local_session->to_server;
+    while (1) {
+      uint32_t tail = atomic_load(&ring->tail);
+      sent = shm_ring_write(ring, buf, len, 0);
+      if (sent >= 0 || errno != EAGAIN) {
+        break;
+      }
+      shm_ring_wait(&ring->tail, &ring->producer_waiting, tail, 1000);
+
+      struct pollfd peer = {client_socket, POLLIN, 0};
+      if (poll(&peer, 1, 0) > 0) {
+        errno = EPIPE;
+        break;
+      }
+    }
+  } else {
+    sent = send(client_socket, buf, len, 0);
+  }
+  pthread_mutex_unlock(&send_lock);
+
+  return sent;
+}
+
+ssize_t client_recv(void *buf, size_t len) {
+  if (local_session != NULL) {
+    // Sem mensagens no anel, o socket do handshake indica se o servidor caiu
+    while (1) {
+      ssize_t received =
+          shm_ring_read(&local_session->to_client, buf, len, 1000);
+      if (received > 0) {
+        return received;
+      }
+      if (interrupted) {
+        errno = EINTR;
+        return -1;
+      }
+
+      struct pollfd peer = {client_socket, POLLIN, 0};
+      if (poll(&peer, 1, 0) > 0) {
+        return 0;
+      }
+    }
+  }
+  return recv(client_socket, buf, len, 0);
+}
+
+// Função para receber uma mensagem completa do servidor. Retorna 0 caso a
+// conexão tenha sido encerrada
+int recv_message(aviator_msg *message) {
+  return recv_full(message, sizeof(aviator_msg));
+}
+
+// Função para receber exatamente len bytes do servidor
+int recv_full(void *buf, size_t len) {
+  size_t received = 0;
+
+  while (received < len) {
+    ssize_t n = client_recv((char *)buf + received, len - received);
+    if (n <= 0) {
+      return 0;
+    }
+    received += n;
+  }
+  return 1;
+}
+
+// Função para enviar periodicamente um "ping", evitando que o servidor
+// considere o cliente inativo enquanto ele apenas assiste às rodadas
+void *handle_heartbeat() {
+  aviator_msg aviator_message;
+
+  while (client_running) {
+    sleep(HEARTBEAT_INTERVAL_S);
+
+    memset(&aviator_message, 0, sizeof(aviator_msg));
+    strcpy(aviator_message.type, "ping");
+    client_send(&aviator_message, sizeof(aviator_msg));
+  }
+
+  return NULL;
+}
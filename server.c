@@ -1,18 +1,65 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "shm_ring.h"
+
 #define STR_LEN 11
 #define PLAYERS_MAX 10
+#define RELAYS_MAX 8
+#define SLOTS_MAX (PLAYERS_MAX * (1 + RELAYS_MAX))
+#define RELAY_ID_SPAN 1000000
+#define CLUSTER_PAYLOAD_MAX 4096
+#define CLUSTER_SEND_TIMEOUT_MS 1000
+#define CLUSTER_SNDBUF (4 * 1024 * 1024)
+#define RELAY_BATCH_SIZE 16384
+#define RELAY_FLUSH_US 1000
+#define SPECTATOR_BACKLOG 256
+#define SPECTATOR_RESEND_MAX 64
+#define CAPTURE_MAGIC "AVCAP1"
+#define TRACE_MAGIC "AVTRC1"
+#define TRACE_BUFFER_RECORDS 4096
+#define RECV_TIMEOUT_MS 1000
+#define IDLE_TIMEOUT_S 60
+#define KEEPALIVE_IDLE_S 10
+#define KEEPALIVE_INTERVAL_S 5
+#define KEEPALIVE_COUNT 3
+#define USER_TIMEOUT_MS 20000
+#define RATE_LIMIT_PER_S 20
+#define RATE_LIMIT_BURST 40
+#define RATE_VIOLATIONS_MAX 100
+#define SLOW_DROPS_MAX 50
+#define THREADS_MAX 64
+#define LEADERBOARD_TOP_K 5
+#define TIER_REDUCED_EVERY 5
+#define TIER_MILESTONE_STEP 50
+#define HISTORY_SIZE 128
+#define HISTORY_SNAPSHOT 10
+#define HISTORY_PAGE_MAX 20
+#define SIM_BET_PROBABILITY 0.8
+#define SIM_BET_MAX 100
+#define SIM_HISTOGRAM_BINS 2000
 
 typedef struct {
   int32_t player_id;
@@ -22,41 +69,501 @@ typedef struct {
   float house_profit;
 } aviator_msg;
 
+struct transport_ops;
+
 typedef struct {
   int socket_conn;
   int player_id;
   float current_bet;
-  float profit;
+  double profit;
   int has_bet;
   int has_cashed_out;
+  int profit_changed;
   int active;
+  int tier;
   pthread_t client_thread;
+  const struct transport_ops *transport;
+  void *transport_ctx;
+  // Controle de conexões problemáticas: atividade, token bucket de
+  // mensagens recebidas e envios descartados por consumidor lento. Os envios
+  // vêm do fan-out e da própria thread do cliente, por isso os dois últimos
+  // campos são atômicos
+  uint64_t last_activity_ns;
+  uint64_t last_refill_ns;
+  float tokens;
+  int rate_violations;
+  atomic_int send_drops;
+  const char *_Atomic evict_reason;
 } client_info;
 
+// Tipos de registro da captura de uma sessão. Os eventos do motor do jogo
+// dão o contexto da rodada para as mensagens dos clientes no replay
+typedef enum {
+  CAPTURE_JOIN,
+  CAPTURE_LEAVE,
+  CAPTURE_MESSAGE,
+  CAPTURE_ROUND_START,
+  CAPTURE_CLOSED,
+  CAPTURE_EXPLODE,
+} CaptureKinds;
+
+typedef struct {
+  char magic[8];
+  uint32_t record_size;
+} capture_header;
+
+// Registro da captura. Para eventos do motor o valor associado (explosão)
+// fica em message.value
+typedef struct {
+  uint64_t timestamp_ns;
+  uint32_t round_id;
+  int32_t kind;
+  int32_t player_id;
+  int32_t phase;
+  float mult;
+  aviator_msg message;
+} capture_record;
+
+// Resumo de um worker da simulação. O histograma das explosões (em passos
+// de 0.01x a partir de 1x) permite calcular percentis após juntar os workers
+typedef struct {
+  uint64_t rounds;
+  uint64_t bets;
+  uint64_t cashouts;
+  double total_staked;
+  double house_profit;
+  double explosion_sum;
+  float explosion_max;
+  uint64_t virtual_us;
+  uint64_t histogram[SIM_HISTOGRAM_BINS];
+} sim_summary;
+
+// Camada de transporte dos clientes: os caminhos de envio e recebimento do
+// servidor não dependem de como o cliente está conectado. O close pode vir
+// de qualquer thread e apenas encerra a conexão; o release, opcional, libera
+// os recursos do transporte na thread dona do cliente, após o seu último uso
+typedef struct transport_ops {
+  const char *name;
+  ssize_t (*send)(client_info *client, const void *buf, size_t len);
+  ssize_t (*recv)(client_info *client, void *buf, size_t len);
+  void (*close)(client_info *client);
+  void (*release)(int socket_conn, void *transport_ctx);
+} transport_ops;
+
+// Sessão de um cliente local via memória compartilhada. O servidor tem
+// vários produtores para o mesmo cliente (thread do jogo e thread do
+// cliente), então os envios são serializados pelo send_lock
+typedef struct {
+  shm_session *session;
+  pthread_mutex_t send_lock;
+  atomic_int closed;
+} shm_transport_ctx;
+
+// Contadores de proteção do servidor, exibidos no encerramento e via SIGUSR1
+typedef struct {
+  atomic_ulong evicted_eof;
+  atomic_ulong evicted_error;
+  atomic_ulong evicted_idle;
+  atomic_ulong evicted_flood;
+  atomic_ulong evicted_slow;
+  atomic_ulong rate_limited;
+  atomic_ulong dropped_sends;
+  atomic_ulong cluster_broadcasts;
+  atomic_ulong cluster_directs;
+  atomic_ulong relay_frames;
+  atomic_ulong relay_flushes;
+  atomic_ulong tick_sends;
+  atomic_ulong tick_skips;
+  atomic_ulong trace_dropped;
+} server_counters;
+
+// Nó do ranking de profit: uma treap com tamanho das subárvores (árvore de
+// estatística de ordem), um nó por espaço de cliente indexado pelo mesmo
+// índice de clients
+typedef struct {
+  double profit;
+  int player_id;
+  uint32_t priority;
+  int left;
+  int right;
+  int size;
+  int in_tree;
+} rank_node;
+
+// Resultado de uma rodada guardado no histórico
+typedef struct {
+  uint32_t round_id;
+  int32_t players;
+  float explosion;
+  float total_staked;
+  float house_delta;
+} history_entry;
+
+// Espaço do anel de histórico com seqlock: a thread do jogo é a única
+// escritora e os leitores repetem a cópia caso ela mude durante a leitura
+typedef struct {
+  _Atomic uint32_t seq;
+  history_entry entry;
+} history_slot;
+
+// Níveis de assinatura do fluxo do multiplicador. Quem tem uma aposta viva
+// durante o voo sempre recebe o fluxo completo
+typedef enum {
+  TIER_FULL,
+  TIER_REDUCED,
+  TIER_MILESTONES,
+  TIER_ROUNDS,
+  TIERS_COUNT,
+} SubscriptionTiers;
+
+// Papéis das threads do servidor para fins de afinidade e escalonamento
+typedef enum {
+  ROLE_GAME,
+  ROLE_IO,
+  ROLE_BACKGROUND,
+  ROLES_COUNT,
+} ThreadRoles;
+
+// Configuração de posicionamento de um papel: núcleos permitidos e política
+// de escalonamento
+typedef struct {
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_sched;
+  int policy;
+  int priority;
+} thread_placement;
+
+// Etapas marcadas pelo tracing de latência: o fan-out de cada tick (do
+// avanço do multiplicador ao fim do último envio) e o caminho do cashout
+// (recebimento, aplicação no jogo e envio do payout)
+typedef enum {
+  TRACE_TICK,
+  TRACE_SEND_BEGIN,
+  TRACE_SEND_END,
+  TRACE_FANOUT_END,
+  TRACE_CASHOUT_RECV,
+  TRACE_CASHOUT_APPLIED,
+  TRACE_PAYOUT_SENT,
+} TraceStages;
+
+// Registro do trace. Envios para um relay usam o id negativo do relay
+typedef struct {
+  uint64_t timestamp_ns;
+  uint32_t round_id;
+  uint32_t tick;
+  int32_t stage;
+  int32_t player_id;
+} trace_record;
+
+// Metade de um buffer de trace. Uma metade cheia entra na fila da thread de
+// escrita, que a devolve vazia
+typedef struct trace_half {
+  uint32_t count;
+  atomic_int queued;
+  struct trace_half *next;
+  trace_record records[TRACE_BUFFER_RECORDS];
+} trace_half;
+
+// Buffer de trace de uma thread em duas metades: enquanto uma é gravada no
+// arquivo, a thread segue marcando na outra sem tocar em I/O
+typedef struct {
+  trace_half halves[2];
+  int current;
+  atomic_int writing;
+} trace_buffer;
+
+// Métricas de cada thread, alocadas pela própria thread após o pinning para
+// ficarem na memória do seu nó NUMA
+typedef struct {
+  char name[16];
+  int role;
+  pid_t tid;
+  clockid_t clock;
+  int last_cpu;
+  uint64_t sampled_migrations;
+  trace_buffer *trace;
+} thread_stats;
+
+// Tipos de quadro do enlace entre o motor do jogo e os relays. O motor envia
+// o fluxo da rodada uma única vez por relay (BROADCAST) e as respostas
+// individuais (DIRECT); o relay envia as entradas, saídas e mensagens dos
+// seus jogadores
+typedef enum {
+  CLUSTER_HELLO,
+  CLUSTER_BROADCAST,
+  CLUSTER_DIRECT,
+  CLUSTER_JOIN,
+  CLUSTER_LEAVE,
+  CLUSTER_MESSAGE,
+} ClusterFrames;
+
+// Cabeçalho de um quadro do enlace, seguido de length bytes de payload
+typedef struct {
+  int32_t kind;
+  int32_t player_id;
+  uint32_t length;
+} cluster_frame;
+
+// Enlace do motor com um relay. Os jogadores do relay ocupam espaços
+// remotos de clients com o transporte de relay apontando para o enlace
+typedef struct {
+  int socket_conn;
+  int relay_id;
+  int active;
+  const char *down_reason;
+  pthread_mutex_t send_lock;
+  pthread_t link_thread;
+} relay_link;
+
+// Fases da rodada publicadas no feed de espectadores
+typedef enum {
+  PHASE_WAIT,
+  PHASE_BET,
+  PHASE_FLIGHT,
+} RoundPhases;
+
+// Mensagem do feed multicast de espectadores. O seq é global e contínuo, o
+// que permite ao espectador detectar perdas e pedir retransmissão
+typedef struct {
+  uint32_t seq;
+  uint32_t round_id;
+  int32_t phase;
+  float value;
+  char type[STR_LEN];
+} spectator_msg;
+
 // Variáveis globais para acompanhamento de estados
 int server_socket;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-client_info clients[PLAYERS_MAX];
-float house_profit = 0;
+client_info clients[SLOTS_MAX];
+// Acumuladores em double: somados a cada rodada, em float eles perdem a
+// precisão dos centavos após poucas centenas de milhares de rodadas
+double house_profit = 0;
 int server_running = 1;
 int is_bet_phase = 0;
 int is_flight_phase = 0;
 float mult = 1;
 float explosion = 0;
 float countdown = 10;
-int compute_ended = 0;
+uint32_t round_id = 0;
+int next_user_id = 1;
+server_counters counters;
+history_slot history_ring[HISTORY_SIZE];
+_Atomic uint32_t history_count = 0;
+int round_players = 0;
+float round_staked = 0;
+double round_house_start = 0;
+rank_node rank_nodes[SLOTS_MAX];
+int rank_root = -1;
+int tier_members[TIERS_COUNT][PLAYERS_MAX];
+int tier_counts[TIERS_COUNT];
+int tiers_dirty = 1;
+int tier_subscribers = 0;
+uint32_t flight_ticks = 0;
+volatile sig_atomic_t metrics_requested = 0;
+volatile sig_atomic_t shutdown_requested = 0;
+pthread_t main_thread;
+
+// Estado do posicionamento das threads
+thread_placement placements[ROLES_COUNT];
+pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_stats *thread_registry[THREADS_MAX];
+uint64_t retired_cpu_ns[ROLES_COUNT];
+uint64_t retired_threads[ROLES_COUNT];
+__thread thread_stats *self_stats = NULL;
+
+// Estado do tracing de latência
+char *trace_path = NULL;
+FILE *trace_file = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t trace_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_queue_ready = PTHREAD_COND_INITIALIZER;
+trace_half *trace_queue_head = NULL;
+trace_half *trace_queue_tail = NULL;
+atomic_int trace_closed = 0;
+pthread_t trace_writer;
+uint32_t trace_tick = 0;
+__thread trace_buffer *self_trace = NULL;
+__thread int trace_fanout = 0;
+const char *role_names[ROLES_COUNT] = {"game", "io", "background"};
+
+// Estado do feed de espectadores (UDP multicast)
+int spectator_enabled = 0;
+int spectator_socket = -1;
+struct sockaddr_in spectator_group;
+struct in_addr spectator_if;
+pthread_mutex_t spectator_lock = PTHREAD_MUTEX_INITIALIZER;
+spectator_msg spectator_backlog[SPECTATOR_BACKLOG];
+uint32_t spectator_seq = 0;
+
+// Estado da captura de sessões para replay
+FILE *capture_file = NULL;
+uint64_t capture_started_ns = 0;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+int log_enabled = 1;
+
+// Estado do modo de simulação (relógio virtual e apostadores sintéticos)
+int simulation_mode = 0;
+uint64_t virtual_clock_us = 0;
+unsigned int sim_seed = 0;
+float sim_targets[PLAYERS_MAX];
+uint32_t sim_decided_round[PLAYERS_MAX];
+
+// Estado do modo cluster: o motor aceita relays em cluster_port e um relay
+// encaminha os seus jogadores para o motor em relay_upstream
+int cluster_port = 0;
+int cluster_socket = -1;
+relay_link relay_links[RELAYS_MAX];
+char *relay_upstream = NULL;
+int relay_mode = 0;
+int upstream_socket = -1;
+pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t relay_pending = PTHREAD_COND_INITIALIZER;
+pthread_cond_t relay_drained = PTHREAD_COND_INITIALIZER;
+char relay_batches[2][RELAY_BATCH_SIZE];
+char *relay_batch = relay_batches[0];
+size_t relay_batch_len = 0;
+
+// Estado do transporte por memória compartilhada
+char *shm_path = NULL;
+char *capture_path = NULL;
+int shm_listen_socket = -1;
 
 // Hoisting de funções
 void endWithErrorMessage(const char *message);
 void *handle_client(void *arg);
+void release_transport(client_info *client, const transport_ops *transport,
+                       int socket_conn, void *transport_ctx);
 void *handle_game(void *arg);
 float game_explosion(int *act_players, float *bet_total);
 void send_all_message(aviator_msg *message);
+void send_all_buffer(const void *buf, size_t len);
+void send_tick(aviator_msg *message);
+void fanout_send(client_info *client, const void *buf, size_t len);
+void rebuild_tiers();
+int tier_due(int tier, uint32_t tick, float value);
+void apply_subscription(client_info *client, float value);
 void start_new_game();
 void remove_client(int player_id);
 void reset_past_play();
 void calculate_end_game();
-void shutdown_server(int signal);
+void prepare_round();
+float close_bets();
+void flight_tick();
+void explode_round(float explosion_limit);
+int process_client_message(client_info *client, aviator_msg *aviator_message);
+float play_round();
+void game_sleep(useconds_t usec);
+void shutdown_server();
+void request_shutdown(int signal);
+void parse_options(int argc, char *argv[], int first);
+void spectator_start(int port);
+void spectator_publish(const char *type, float value);
+void *handle_spectator_requests(void *arg);
+int claim_slot(int socket_conn, const transport_ops *transport,
+               void *transport_ctx);
+int claim_slot_in(int first, int last, int socket_conn,
+                  const transport_ops *transport, void *transport_ctx,
+                  int player_id);
+int register_client(int socket_conn, const transport_ops *transport,
+                    void *transport_ctx);
+ssize_t client_send(client_info *client, const void *buf, size_t len);
+ssize_t client_recv(client_info *client, void *buf, size_t len);
+void client_close(client_info *client);
+ssize_t tcp_send(client_info *client, const void *buf, size_t len);
+ssize_t tcp_recv(client_info *client, void *buf, size_t len);
+void tcp_close(client_info *client);
+ssize_t shm_send(client_info *client, const void *buf, size_t len);
+ssize_t shm_recv(client_info *client, void *buf, size_t len);
+void shm_close(client_info *client);
+void shm_release(int socket_conn, void *transport_ctx);
+void shm_start(const char *path);
+void *handle_shm_clients(void *arg);
+ssize_t null_send(client_info *client, const void *buf, size_t len);
+ssize_t null_recv(client_info *client, void *buf, size_t len);
+void null_close(client_info *client);
+ssize_t relay_send(client_info *client, const void *buf, size_t len);
+ssize_t relay_recv(client_info *client, void *buf, size_t len);
+void relay_close(client_info *client);
+int cluster_write(int socket_conn, const void *buf, size_t len);
+int cluster_read(int socket_conn, void *buf, size_t len);
+int cluster_recv_frame(int socket_conn, cluster_frame *frame, void *payload);
+int cluster_send(relay_link *link, int kind, int player_id, const void *buf,
+                 size_t len);
+void cluster_broadcast(const void *buf, size_t len);
+void configure_cluster_link(int socket_conn);
+void cluster_start(int port);
+void *handle_cluster_links(void *arg);
+void *handle_relay_link(void *arg);
+void relay_link_join(relay_link *link, int player_id);
+client_info *find_client(int player_id);
+void relay_connect(const char *upstream);
+void relay_forward(int kind, int player_id, const void *buf, size_t len);
+void relay_flush();
+void *handle_relay_flush(void *arg);
+void *handle_upstream(void *arg);
+int relay_client_message(client_info *client, aviator_msg *aviator_message);
+void relay_follow_round(const aviator_msg *event);
+void capture_start(const char *path);
+void capture_event(int kind, int player_id, float value);
+void capture_message(client_info *client, aviator_msg *message);
+void capture_stop();
+int run_replay(const char *path, int realtime);
+int run_simulation(int argc, char *argv[]);
+void simulate_bettors();
+void sim_worker(int worker, uint64_t rounds, int players, FILE *rounds_csv,
+                sim_summary *summary);
+void configure_tcp_client(int socket_conn);
+int recv_message(client_info *client, aviator_msg *message);
+int allow_message(client_info *client);
+void mark_for_eviction(client_info *client, const char *reason);
+void evict_client(client_info *client, const char *reason);
+void request_metrics(int signal);
+void print_metrics();
+void parse_placement(const char *value, thread_placement *placement,
+                     int is_sched);
+void thread_setup(int role, const char *name);
+void thread_teardown();
+void thread_sample();
+void *thread_local_alloc(size_t size);
+void thread_local_free(void *ptr, size_t size);
+uint64_t thread_migrations(thread_stats *stats);
+void trace_start(const char *path);
+void trace_point(int stage, int player_id, uint64_t timestamp_ns);
+void trace_tick_begin();
+void trace_tick_end();
+void trace_submit(trace_buffer *buffer);
+void trace_write(trace_half *half);
+trace_half *trace_dequeue();
+void *handle_trace_writer(void *arg);
+void trace_retire(trace_buffer *buffer);
+void trace_stop();
+int rank_before(int a, int b);
+int rank_size(int node);
+void rank_refresh(int node);
+void rank_split(int node, int key, int *before, int *after);
+int rank_merge(int before, int after);
+int rank_remove(int node, int key);
+void leaderboard_insert(int slot);
+void leaderboard_erase(int slot);
+void leaderboard_update(int slot);
+int leaderboard_rank(int slot);
+int leaderboard_top(int k, int *slots);
+void broadcast_leaderboard();
+void history_record(float explosion);
+int history_read(uint32_t before_round, int max, history_entry *out);
+void send_history(client_info *client, uint32_t before_round, int max);
+uint64_t now_ns();
+int compare_u64(const void *a, const void *b);
+
+const transport_ops tcp_transport = {"tcp", tcp_send, tcp_recv, tcp_close};
+const transport_ops shm_transport = {"shm", shm_send, shm_recv, shm_close,
+                                     shm_release};
+const transport_ops null_transport = {"null", null_send, null_recv,
+                                      null_close};
+const transport_ops relay_transport = {"relay", relay_send, relay_recv,
+                                       relay_close};
 void logger(const char *event, int player_id, float multiplier, float explosion,
             int num_players, float total_bet, float bet, float payout,
             float player_profit, float house_profit);
@@ -68,17 +575,36 @@ int main(int argc, char *argv[]) {
   void *addr_ptr;
   socklen_t addr_len;
   pthread_t game_thread;
-  aviator_msg aviator_message;
-  int user_id = 1;
+  pthread_t spectator_thread;
+  pthread_t shm_thread;
+  pthread_t cluster_thread;
+  pthread_t upstream_thread;
+  pthread_t flush_thread;
+  sigset_t sigint_set;
+  sigset_t accept_mask;
+  struct pollfd listener;
   int is_IPv4 = 0;
   int port;
 
   // Caso o numero de argumentos passados ao processo não seja condizente com
   // o necessário deve-se encerrar o programa
-  if (argc != 3) {
+  if (argc < 3) {
     endWithErrorMessage("Invalid number of arguments");
   }
 
+  // Modo de replay de uma sessão capturada: ./bin/server replay <arquivo>
+  // [realtime|fast]
+  if (strcmp(argv[1], "replay") == 0) {
+    int realtime = argc > 3 && strcmp(argv[3], "realtime") == 0;
+    return run_replay(argv[2], realtime);
+  }
+
+  // Modo de simulação headless com relógio virtual: ./bin/server sim
+  // <rodadas> [-workers N] [-players N] [-seed S] [-rounds-csv arquivo]
+  if (strcmp(argv[1], "sim") == 0) {
+    return run_simulation(argc, argv);
+  }
+
   // Indicando o protocolo a ser utilizado no programa
   if (strcmp(argv[1], "v4") == 0) {
     is_IPv4 = 1;
@@ -95,6 +621,9 @@ int main(int argc, char *argv[]) {
     endWithErrorMessage("Invalid port");
   }
 
+  // Opções adicionais após o protocolo e a porta
+  parse_options(argc, argv, 3);
+
   if (is_IPv4 == 1) {
     // Socket IPv4
     memset(&server_addr_ipv4, 0, sizeof(server_addr_ipv4));
@@ -145,54 +674,98 @@ int main(int argc, char *argv[]) {
     endWithErrorMessage("Error while listening in the socket");
   }
 
-  signal(SIGINT, shutdown_server);
+  // O SIGINT apenas marca o pedido de encerramento, que é feito pela thread
+  // principal. Ele fica bloqueado em todas as threads e só é entregue à
+  // principal enquanto ela espera por conexões, interrompendo a espera
+  signal(SIGINT, request_shutdown);
+  signal(SIGUSR1, request_metrics);
+  main_thread = pthread_self();
+  sigemptyset(&sigint_set);
+  sigaddset(&sigint_set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint_set, &accept_mask);
+
+  // Um envio para um cliente que caiu não pode derrubar o servidor
+  signal(SIGPIPE, SIG_IGN);
+
+  // Relay: o processo apenas termina as conexões dos jogadores. O enlace com
+  // o motor é estabelecido antes de aceitar clientes para que os ids do
+  // relay já estejam definidos
+  if (relay_mode) {
+    relay_connect(relay_upstream);
+  }
+
+  if (capture_path != NULL) {
+    capture_start(capture_path);
+  }
 
-  // Separando a execução do jogo em outra thread, mantendo a main thread de
-  // sem locks
-  pthread_create(&game_thread, NULL, handle_game, NULL);
+  // O arquivo precisa existir antes das threads alocarem os seus buffers
+  if (trace_path != NULL) {
+    trace_start(trace_path);
+  }
 
-  while (server_running) {
+  // Feed de espectadores: um único datagrama por evento, independente do
+  // número de espectadores. Retransmissões são pedidas via unicast na mesma
+  // porta do servidor
+  if (spectator_enabled) {
+    spectator_start(port);
+    pthread_create(&spectator_thread, NULL, handle_spectator_requests, NULL);
+  }
 
-    client_socket_conn = accept(server_socket, addr_ptr, &addr_len);
-    if (client_socket_conn < 0) {
-      endWithErrorMessage("Failed to acccept client socket connection");
+  // Clientes locais (bots e relays na mesma máquina) podem trocar mensagens
+  // por memória compartilhada em vez de TCP
+  if (shm_path != NULL) {
+    shm_start(shm_path);
+    pthread_create(&shm_thread, NULL, handle_shm_clients, NULL);
+  }
+
+  if (relay_mode) {
+    // O relógio do jogo fica no motor: o relay repassa o fluxo da rodada aos
+    // seus clientes e envia as mensagens deles em lotes
+    pthread_create(&upstream_thread, NULL, handle_upstream, NULL);
+    pthread_create(&flush_thread, NULL, handle_relay_flush, NULL);
+  } else {
+    // Motor do cluster: relays conectam numa porta própria
+    if (cluster_port > 0) {
+      cluster_start(cluster_port);
+      pthread_create(&cluster_thread, NULL, handle_cluster_links, NULL);
     }
 
-    // Procedimento para checar se o limite de jogadores foi ultrapassado
-    pthread_mutex_lock(&lock);
-    int available_idx = -1;
-    for (int i = 0; i < PLAYERS_MAX; i++) {
-      if (!clients[i].active) {
-        available_idx = i;
-        break;
+    // Separando a execução do jogo em outra thread, mantendo a main thread de
+    // sem locks
+    pthread_create(&game_thread, NULL, handle_game, NULL);
+  }
+
+  // A thread principal passa a ser a thread de I/O que aceita conexões
+  thread_setup(ROLE_IO, "accept");
+
+  listener.fd = server_socket;
+  listener.events = POLLIN;
+
+  while (!shutdown_requested) {
+    if (ppoll(&listener, 1, NULL, &accept_mask) < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      endWithErrorMessage("Failed to wait for client socket connections");
     }
 
-    if (available_idx != -1) {
-      clients[available_idx].socket_conn = client_socket_conn;
-      clients[available_idx].player_id = user_id;
-      clients[available_idx].profit = 0;
-      clients[available_idx].current_bet = 0;
-      clients[available_idx].has_bet = 0;
-      clients[available_idx].has_cashed_out = 0;
-      clients[available_idx].active = 1;
+    client_socket_conn = accept(server_socket, addr_ptr, &addr_len);
+    if (client_socket_conn < 0) {
+      endWithErrorMessage("Failed to acccept client socket connection");
+    }
 
-      // Invocação da função do jogo, sem bloquear a thread de conexões
-      pthread_create(&clients[available_idx].client_thread, NULL, handle_client,
-                     &clients[available_idx]);
+    configure_tcp_client(client_socket_conn);
 
-      user_id++;
-    } else {
+    // Procedimento para checar se o limite de jogadores foi ultrapassado
+    if (register_client(client_socket_conn, &tcp_transport, NULL) < 0) {
       // Fechando a conexão por falta de espaço no jogo
-      memset(&aviator_message, 0, sizeof(aviator_msg));
-      snprintf(aviator_message.type, STR_LEN, "bye");
-
       printf("Max number of players reached.\n");
       close(client_socket_conn);
     }
-    pthread_mutex_unlock(&lock);
   }
 
+  shutdown_server();
+
   // Fechando as conexões gerais
   close(server_socket);
 
@@ -201,7 +774,7 @@ int main(int argc, char *argv[]) {
 
 // Função de handler para a execução do jogo ser em uma outra thread
 void *handle_game(void *arg) {
-  aviator_msg aviator_message;
+  thread_setup(ROLE_GAME, "game");
 
   while (server_running) {
     // Aguardar pelo menos um cliente se conectar para de fato a partida
@@ -209,59 +782,127 @@ void *handle_game(void *arg) {
     int client_num = 0;
     while (!client_num) {
       pthread_mutex_lock(&lock);
-      for (int i = 0; i < PLAYERS_MAX; i++) {
+      for (int i = 0; i < SLOTS_MAX; i++) {
         if (clients[i].active) {
           client_num++;
           break;
         }
       }
       pthread_mutex_unlock(&lock);
+
+      // Evitando consumir um núcleo inteiro enquanto ninguém está conectado
+      if (!client_num) {
+        usleep(100000);
+      }
     }
 
     // Partida irá começar
-    start_new_game();
-
-    float total_bet = 0;
-    int active_players = 0;
+    play_round();
 
-    // Fechando as apostas e comunicando aos clientes
-    memset(&aviator_message, 0, sizeof(aviator_msg));
-    strcpy(aviator_message.type, "closed");
-    send_all_message(&aviator_message);
+    if (metrics_requested) {
+      metrics_requested = 0;
+      print_metrics();
+    }
 
-    float explosion_limit = game_explosion(&active_players, &total_bet);
-    logger("closed", -1, 0, 0, active_players, total_bet, 0, 0, 0, 0);
+    // Fazendo uma pausa de 5 segundos para a próxima rodada
+    game_sleep(5000000);
+  }
+  return NULL;
+}
 
-    // Considerando oficialmente o começo da fase de voo
-    is_bet_phase = 0;
-    is_flight_phase = 1;
+// Função para executar uma rodada completa, da abertura das apostas até a
+// liquidação. Retorna o multiplicador da explosão
+float play_round() {
+  start_new_game();
 
-    while (mult < explosion_limit) {
-      memset(&aviator_message, 0, sizeof(aviator_msg));
-      strcpy(aviator_message.type, "multiplier");
-      aviator_message.value = mult;
-      send_all_message(&aviator_message);
+  float explosion_limit = close_bets();
 
-      logger("multiplier", -1, mult, 0, 0, 0, 0, 0, 0, 0);
+  while (mult < explosion_limit) {
+    flight_tick();
+    thread_sample();
 
-      usleep(100000);
-      mult += 0.01;
-    }
+    game_sleep(100000);
+    mult += 0.01;
+  }
 
-    // Informando aos clientes a explosão do avião
-    is_flight_phase = 0;
-    memset(&aviator_message, 0, sizeof(aviator_msg));
-    strcpy(aviator_message.type, "explode");
-    aviator_message.value = explosion_limit;
-    send_all_message(&aviator_message);
-    logger("explode", -1, explosion_limit, 0, 0, 0, 0, 0, 0, 0);
+  explode_round(explosion_limit);
 
-    calculate_end_game();
+  return explosion_limit;
+}
 
-    // Fazendo uma pausa de 5 segundos para a próxima rodada
-    sleep(5);
+// Função para aguardar entre as etapas da rodada. No modo de simulação o
+// relógio é virtual: o tempo só avança e os apostadores sintéticos agem
+// como clientes reais agiriam nesse intervalo
+void game_sleep(useconds_t usec) {
+  if (simulation_mode) {
+    virtual_clock_us += usec;
+    simulate_bettors();
+    return;
   }
-  return NULL;
+  usleep(usec);
+}
+
+// Função para fechar as apostas e iniciar a fase de voo, retornando o
+// multiplicador em que o avião irá explodir
+float close_bets() {
+  aviator_msg aviator_message;
+  float total_bet = 0;
+  int active_players = 0;
+
+  // Fechando as apostas e comunicando aos clientes
+  memset(&aviator_message, 0, sizeof(aviator_msg));
+  aviator_message.player_id = round_id;
+  strcpy(aviator_message.type, "closed");
+  send_all_message(&aviator_message);
+
+  float explosion_limit = game_explosion(&active_players, &total_bet);
+  round_players = active_players;
+  round_staked = total_bet;
+  logger("closed", -1, 0, 0, active_players, total_bet, 0, 0, 0, 0);
+
+  // Considerando oficialmente o começo da fase de voo. Quem apostou passa a
+  // receber todos os ticks
+  is_bet_phase = 0;
+  is_flight_phase = 1;
+  flight_ticks = 0;
+  tiers_dirty = 1;
+  spectator_publish("closed", 0);
+  capture_event(CAPTURE_CLOSED, -1, explosion_limit);
+
+  return explosion_limit;
+}
+
+// Função para comunicar o multiplicador atual durante o voo
+void flight_tick() {
+  aviator_msg aviator_message;
+
+  trace_tick_begin();
+  memset(&aviator_message, 0, sizeof(aviator_msg));
+  strcpy(aviator_message.type, "multiplier");
+  aviator_message.value = mult;
+  send_tick(&aviator_message);
+  flight_ticks++;
+  trace_tick_end();
+  spectator_publish("multiplier", mult);
+
+  logger("multiplier", -1, mult, 0, 0, 0, 0, 0, 0, 0);
+}
+
+// Função para informar aos clientes a explosão do avião e liquidar a rodada
+void explode_round(float explosion_limit) {
+  aviator_msg aviator_message;
+
+  is_flight_phase = 0;
+  memset(&aviator_message, 0, sizeof(aviator_msg));
+  strcpy(aviator_message.type, "explode");
+  aviator_message.value = explosion_limit;
+  send_all_message(&aviator_message);
+  spectator_publish("explode", explosion_limit);
+  logger("explode", -1, explosion_limit, 0, 0, 0, 0, 0, 0, 0);
+  capture_event(CAPTURE_EXPLODE, -1, explosion_limit);
+
+  calculate_end_game();
+  history_record(explosion_limit);
 }
 
 // Função para fazer todos os cálculos referentes ao fim da rodada
@@ -270,11 +911,12 @@ void calculate_end_game() {
 
   // Processar perdas dos jogadores que não sacaram
   pthread_mutex_lock(&lock);
-  for (int i = 0; i < PLAYERS_MAX; i++) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
     // Caso o jogador tenha feito uma aposta e não tenha realizado cashout
     // deverá ser calculado a sua perda e o lucro da casa
     if (clients[i].active && clients[i].has_bet && !clients[i].has_cashed_out) {
       clients[i].profit -= clients[i].current_bet;
+      clients[i].profit_changed = 1;
       house_profit += clients[i].current_bet;
 
       logger("profit", clients[i].player_id, 0, 0, 0, 0, 0, 0,
@@ -282,18 +924,37 @@ void calculate_end_game() {
     }
   }
 
-  for (int i = 0; i < PLAYERS_MAX; i++) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
     if (clients[i].active && clients[i].has_bet && !clients[i].has_cashed_out) {
       memset(&aviator_message, 0, sizeof(aviator_msg));
       strcpy(aviator_message.type, "profit");
       aviator_message.house_profit = house_profit;
       aviator_message.player_profit = clients[i].profit;
-      send(clients[i].socket_conn, &aviator_message, sizeof(aviator_msg), 0);
+      client_send(&clients[i], &aviator_message, sizeof(aviator_msg));
+    } else if (clients[i].active && clients[i].has_cashed_out) {
+      // Quem sacou já recebeu o payout, falta apenas o valor final da casa
+      memset(&aviator_message, 0, sizeof(aviator_msg));
+      strcpy(aviator_message.type, "profit");
+      aviator_message.player_id = clients[i].player_id;
+      aviator_message.house_profit = house_profit;
+      client_send(&clients[i], &aviator_message, sizeof(aviator_msg));
+
+      logger("profit", clients[i].player_id, 0, 0, 0, 0, 0, 0,
+             clients[i].profit, 0);
+    }
+  }
+
+  // Apenas quem teve o saldo alterado na rodada é reposicionado no ranking
+  for (int i = 0; i < SLOTS_MAX; i++) {
+    if (clients[i].active && clients[i].profit_changed) {
+      leaderboard_update(i);
+      clients[i].profit_changed = 0;
     }
   }
 
   pthread_mutex_unlock(&lock);
-  compute_ended = 1;
+
+  broadcast_leaderboard();
 }
 
 // Função de handler para conexões de clientes
@@ -301,110 +962,221 @@ void *handle_client(void *arg) {
   client_info *client = (client_info *)arg;
   aviator_msg aviator_message;
 
-  while (client->active && server_running) {
+  // O espaço pode ser reaproveitado por outro cliente após a saída, então o
+  // transporte a ser liberado no fim é guardado na entrada
+  const transport_ops *transport = client->transport;
+  int socket_conn = client->socket_conn;
+  void *transport_ctx = client->transport_ctx;
+
+  // Ninguém aguarda o fim dessa thread, os recursos são liberados sozinhos
+  pthread_detach(pthread_self());
+  thread_setup(ROLE_IO, "client");
+
+  // No relay o estado da rodada e o histórico vêm do motor, que os envia ao
+  // receber a entrada do jogador
+  if (!relay_mode) {
     // Caso o cliente entre no meio da rodada
     if (is_flight_phase) {
       memset(&aviator_message, 0, sizeof(aviator_msg));
       strcpy(aviator_message.type, "closed");
-      send(client->socket_conn, &aviator_message, sizeof(aviator_msg), 0);
+      client_send(client, &aviator_message, sizeof(aviator_msg));
     }
 
+    // Contexto das últimas rodadas num único lote
+    send_history(client, 0, HISTORY_SNAPSHOT);
+  }
+
+  while (client->active && server_running) {
     // Esperando resposta para apostas do cliente
-    recv(client->socket_conn, &aviator_message, sizeof(aviator_msg), 0);
+    int status = recv_message(client, &aviator_message);
+    if (status == 0) {
+      // Fim da conexão sem "bye", ou conexão derrubada por outra thread
+      evict_client(client, client->evict_reason ? client->evict_reason
+                                                : "eof");
+      break;
+    } else if (status < 0) {
+      evict_client(client, status == -2 ? "idle" : "error");
+      break;
+    }
 
-    if (strcmp(aviator_message.type, "bet") == 0 && is_bet_phase) {
-      // Checando caso o cliente já tenha feito uma aposta na rodada
-      if (client->has_bet) {
-        continue;
+    // Mensagens acima do limite são descartadas sem tocar no lock do jogo
+    if (!allow_message(client)) {
+      if (client->rate_violations > RATE_VIOLATIONS_MAX) {
+        evict_client(client, "flood");
+        break;
       }
+      continue;
+    }
 
-      client->current_bet = aviator_message.value;
-      client->has_bet = 1;
-      client->has_cashed_out = 0;
+    capture_message(client, &aviator_message);
+    thread_sample();
 
-      // Calcular total de apostas e número de jogadores para o log
-      int num_players = 0;
-      float total_bet = 0;
+    int keep = relay_mode ? relay_client_message(client, &aviator_message)
+                          : process_client_message(client, &aviator_message);
+    if (!keep) {
+      break;
+    }
+  }
 
-      pthread_mutex_lock(&lock);
-      for (int i = 0; i < PLAYERS_MAX; i++) {
-        if (clients[i].active && clients[i].has_bet) {
-          num_players++;
-          total_bet += clients[i].current_bet;
-        }
-      }
-      pthread_mutex_unlock(&lock);
+  release_transport(client, transport, socket_conn, transport_ctx);
+  thread_teardown();
+  return NULL;
+}
 
-      logger("bet", client->player_id, 0, 0, num_players, total_bet,
-             client->current_bet, 0, 0, 0);
+// Função para liberar o transporte na thread dona do cliente. Com o lock
+// adquirido nenhum fan-out está enviando a ele; um cliente ainda ativo (fim
+// do servidor) mantém o transporte até o encerramento do processo
+void release_transport(client_info *client, const transport_ops *transport,
+                       int socket_conn, void *transport_ctx) {
+  if (transport->release == NULL) {
+    return;
+  }
 
-    } else if (strcmp(aviator_message.type, "cashout") == 0 &&
-               is_flight_phase) {
-      // Checando se o cliente já não realizou um cashout
-      if (client->has_cashed_out) {
-        continue;
-      }
+  pthread_mutex_lock(&lock);
+  if (!client->active || client->transport_ctx != transport_ctx) {
+    transport->release(socket_conn, transport_ctx);
+  }
+  pthread_mutex_unlock(&lock);
+}
 
-      client->has_cashed_out = 1;
-      // Calculando o ganho pelo cliente
-      float payout = client->current_bet * mult;
-      float transaction_balance = payout - client->current_bet;
+// Função para aplicar uma mensagem do cliente ao jogo. Retorna 0 quando o
+// cliente saiu do jogo
+int process_client_message(client_info *client, aviator_msg *aviator_message) {
+  if (strcmp(aviator_message->type, "bet") == 0 && is_bet_phase) {
+    // Checando caso o cliente já tenha feito uma aposta na rodada. O valor
+    // vem do cliente e acaba no profit, que é a chave do ranking: NaN,
+    // infinito ou aposta não positiva são descartados
+    if (client->has_bet || !isfinite(aviator_message->value) ||
+        aviator_message->value <= 0) {
+      return 1;
+    }
 
-      pthread_mutex_lock(&lock);
-      client->profit += transaction_balance;
-      house_profit -= transaction_balance;
-      pthread_mutex_unlock(&lock);
+    client->current_bet = aviator_message->value;
+    client->has_bet = 1;
+    client->has_cashed_out = 0;
 
-      logger("cashout", client->player_id, mult, 0, 0, 0, 0, 0, 0, 0);
+    // Calcular total de apostas e número de jogadores para o log
+    int num_players = 0;
+    float total_bet = 0;
 
-      memset(&aviator_message, 0, sizeof(aviator_msg));
-      strcpy(aviator_message.type, "payout");
-      aviator_message.value = payout;
-      aviator_message.player_id = client->player_id;
-      aviator_message.player_profit = client->profit;
-      aviator_message.house_profit = house_profit;
-      send(client->socket_conn, &aviator_message, sizeof(aviator_msg), 0);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < SLOTS_MAX; i++) {
+      if (clients[i].active && clients[i].has_bet) {
+        num_players++;
+        total_bet += clients[i].current_bet;
+      }
+    }
+    pthread_mutex_unlock(&lock);
 
-      logger("payout", client->player_id, 0, 0, 0, 0, 0, payout, 0, 0);
+    logger("bet", client->player_id, 0, 0, num_players, total_bet,
+           client->current_bet, 0, 0, 0);
+
+    // O relay só conhece as apostas aceitas pelo motor, que são confirmadas
+    // com um quadro direto
+    if (client->transport == &relay_transport) {
+      aviator_msg reply;
+      memset(&reply, 0, sizeof(aviator_msg));
+      strcpy(reply.type, "bet");
+      reply.value = client->current_bet;
+      reply.player_id = client->player_id;
+      client_send(client, &reply, sizeof(aviator_msg));
+    }
 
-      // Loop até que tenha finalizado a computação do jogo, enviando para o
-      // usuário que fez cashout o valor da casa no final
-      while (1) {
-        if (compute_ended) {
-          break;
-        }
-      }
+  } else if (strcmp(aviator_message->type, "cashout") == 0 &&
+             is_flight_phase) {
+    // Checando se o cliente já não realizou um cashout
+    if (client->has_cashed_out) {
+      return 1;
+    }
 
-      // Enviar profit atualizado do jogador
-      memset(&aviator_message, 0, sizeof(aviator_msg));
-      strcpy(aviator_message.type, "profit");
-      aviator_message.player_id = client->player_id;
-      aviator_message.house_profit = house_profit;
-      send(client->socket_conn, &aviator_message, sizeof(aviator_msg), 0);
+    // O recebimento é o instante em que a mensagem ficou completa
+    trace_point(TRACE_CASHOUT_RECV, client->player_id,
+                client->last_activity_ns);
 
-      logger("profit", client->player_id, 0, 0, 0, 0, 0, 0, client->profit, 0);
-    } else if (strcmp(aviator_message.type, "bye") == 0) {
-      remove_client(client->player_id);
-      break;
+    client->has_cashed_out = 1;
+    // Calculando o ganho pelo cliente
+    float payout = client->current_bet * mult;
+    float transaction_balance = payout - client->current_bet;
+
+    pthread_mutex_lock(&lock);
+    client->profit += transaction_balance;
+    client->profit_changed = 1;
+    house_profit -= transaction_balance;
+    tiers_dirty = 1;
+    pthread_mutex_unlock(&lock);
+    trace_point(TRACE_CASHOUT_APPLIED, client->player_id, now_ns());
+
+    logger("cashout", client->player_id, mult, 0, 0, 0, 0, 0, 0, 0);
+
+    // O profit final com o valor da casa é enviado por calculate_end_game
+    // após a explosão
+    aviator_msg reply;
+    memset(&reply, 0, sizeof(aviator_msg));
+    strcpy(reply.type, "payout");
+    reply.value = payout;
+    reply.player_id = client->player_id;
+    reply.player_profit = client->profit;
+    reply.house_profit = house_profit;
+    client_send(client, &reply, sizeof(aviator_msg));
+    trace_point(TRACE_PAYOUT_SENT, client->player_id, now_ns());
+
+    logger("payout", client->player_id, 0, 0, 0, 0, 0, payout, 0, 0);
+  } else if (strcmp(aviator_message->type, "history") == 0) {
+    // Paginação do histórico: player_id indica a rodada a partir da qual
+    // (exclusive) buscar para trás e value a quantidade desejada
+    int max = aviator_message->value;
+    if (max <= 0 || max > HISTORY_PAGE_MAX) {
+      max = HISTORY_PAGE_MAX;
     }
+    send_history(client, aviator_message->player_id, max);
+  } else if (strcmp(aviator_message->type, "rank") == 0) {
+    // Posição do jogador no ranking, consultada em O(log n)
+    aviator_msg reply;
+    memset(&reply, 0, sizeof(aviator_msg));
+    strcpy(reply.type, "rank");
+    reply.player_id = client->player_id;
+
+    pthread_mutex_lock(&lock);
+    int slot = client - clients;
+    reply.value = leaderboard_rank(slot);
+    reply.player_profit = rank_nodes[slot].profit;
+    reply.house_profit = house_profit;
+    pthread_mutex_unlock(&lock);
+
+    client_send(client, &reply, sizeof(aviator_msg));
+  } else if (strcmp(aviator_message->type, "subscribe") == 0) {
+    apply_subscription(client, aviator_message->value);
+  } else if (strcmp(aviator_message->type, "bye") == 0) {
+    remove_client(client->player_id);
+    return 0;
   }
 
-  return NULL;
+  return 1;
 }
 
 // Função para remover um client do jogo, utilizando a flag de active
 void remove_client(int player_id) {
+  int departed = 0;
+
   pthread_mutex_lock(&lock);
-  for (int i = 0; i < PLAYERS_MAX; i++) {
-    if (clients[i].player_id == player_id) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
+    if (clients[i].active && clients[i].player_id == player_id) {
 
+      leaderboard_erase(i);
       clients[i].active = 0;
+      tiers_dirty = 1;
+      if (clients[i].tier != TIER_FULL) {
+        tier_subscribers--;
+        clients[i].tier = TIER_FULL;
+      }
       clients[i].player_id = 0;
       clients[i].profit = 0;
       clients[i].current_bet = 0;
       clients[i].has_bet = 0;
       clients[i].has_cashed_out = 0;
-      close(clients[i].socket_conn);
+      client_close(&clients[i]);
+      capture_event(CAPTURE_LEAVE, player_id, 0);
+      departed = 1;
 
       logger("bye", player_id, 0, 0, 0, 0, 0, 0, 0, 0);
 
@@ -412,12 +1184,32 @@ void remove_client(int player_id) {
     }
   }
   pthread_mutex_unlock(&lock);
+
+  // A saída chega ao motor sem segurar o lock do jogo
+  if (departed && relay_mode) {
+    relay_forward(CLUSTER_LEAVE, player_id, NULL, 0);
+  }
+}
+
+// Função para reiniciar o estado da rodada, abrindo a fase de apostas
+void prepare_round() {
+  is_bet_phase = 1;
+  is_flight_phase = 0;
+  countdown = 10;
+  mult = 1;
+  round_id++;
+  round_players = 0;
+  round_staked = 0;
+  round_house_start = house_profit;
+
+  reset_past_play();
+  capture_event(CAPTURE_ROUND_START, -1, 0);
 }
 
 void reset_past_play() {
   int active_clients = 0;
   pthread_mutex_lock(&lock);
-  for (int i = 0; i < PLAYERS_MAX; i++) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
     if (clients[i].active) {
       active_clients++;
       clients[i].has_bet = 0;
@@ -432,23 +1224,21 @@ void reset_past_play() {
 // Função para preparar o inicio de um novo jogo
 void start_new_game() {
   aviator_msg aviator_message;
-  is_bet_phase = 1;
-  is_flight_phase = 0;
-  countdown = 10;
-  mult = 1;
-  compute_ended = 0;
 
-  reset_past_play();
+  prepare_round();
 
   while (countdown > 0) {
     // Esperar 1 segundo para a nova iteração e enviar aos clientes o countdown
     // referente a sua conexão
     memset(&aviator_message, 0, sizeof(aviator_msg));
     aviator_message.value = countdown;
+    // O id da rodada segue no player_id para que os relays o acompanhem
+    aviator_message.player_id = round_id;
     strcpy(aviator_message.type, "start");
     send_all_message(&aviator_message);
+    spectator_publish("start", countdown);
 
-    sleep(1);
+    game_sleep(1000000);
     countdown--;
   }
 }
@@ -466,7 +1256,7 @@ float game_explosion(int *act_players, float *bet_total) {
   float total_bet = 0;
 
   pthread_mutex_lock(&lock);
-  for (int i = 0; i < PLAYERS_MAX; i++) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
     if (clients[i].active && clients[i].has_bet) {
       active_players++;
       total_bet += clients[i].current_bet;
@@ -486,20 +1276,142 @@ float game_explosion(int *act_players, float *bet_total) {
 // Função para enviar uma mensagem para todos os jogadores disponíveis
 // atualmente
 void send_all_message(aviator_msg *message) {
+  send_all_buffer(message, sizeof(aviator_msg));
+}
+
+// Função para enviar um lote de mensagens a todos os jogadores com uma
+// única escrita por cliente
+void send_all_buffer(const void *buf, size_t len) {
   // Acredito necessitar de um lock para não ocorrer de um cliente deixar de
   // estar ativo no instante em que a mensagem estaria sendo direcionada para
   // ele
   pthread_mutex_lock(&lock);
   for (int i = 0; i < PLAYERS_MAX; i++) {
     if (clients[i].active) {
-      send(clients[i].socket_conn, message, sizeof(aviator_msg), 0);
+      fanout_send(&clients[i], buf, len);
+    }
+  }
+
+  // Jogadores remotos recebem uma única cópia por relay, que faz o fan-out
+  // localmente
+  if (cluster_port > 0) {
+    cluster_broadcast(buf, len);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Função para enviar um tick do multiplicador apenas aos níveis de
+// assinatura que devem recebê-lo. Cada nível tem a sua lista de
+// destinatários, refeita só quando alguém entra, sai, muda de nível ou a
+// aposta muda de estado, então quem não recebe o tick nem é visitado
+void send_tick(aviator_msg *message) {
+  pthread_mutex_lock(&lock);
+  if (tier_subscribers == 0) {
+    // Sem assinantes, como no modo de simulação, todos recebem todos os
+    // ticks e as listas por nível nem são mantidas
+    int sends = 0;
+    for (int i = 0; i < PLAYERS_MAX; i++) {
+      if (clients[i].active) {
+        fanout_send(&clients[i], message, sizeof(aviator_msg));
+        sends++;
+      }
+    }
+    atomic_fetch_add(&counters.tick_sends, sends);
+  } else {
+    if (tiers_dirty) {
+      rebuild_tiers();
+    }
+
+    for (int tier = 0; tier < TIERS_COUNT; tier++) {
+      if (!tier_due(tier, flight_ticks, message->value)) {
+        atomic_fetch_add(&counters.tick_skips, tier_counts[tier]);
+        continue;
+      }
+      for (int i = 0; i < tier_counts[tier]; i++) {
+        fanout_send(&clients[tier_members[tier][i]], message,
+                    sizeof(aviator_msg));
+      }
+      atomic_fetch_add(&counters.tick_sends, tier_counts[tier]);
+    }
+  }
+
+  // Cada relay recebe todos os ticks e aplica os níveis dos seus clientes
+  if (cluster_port > 0) {
+    cluster_broadcast(message, sizeof(aviator_msg));
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Função para enviar a um cliente durante um fan-out, marcando o envio no
+// trace quando o fan-out é de um tick
+void fanout_send(client_info *client, const void *buf, size_t len) {
+  if (trace_fanout) {
+    trace_point(TRACE_SEND_BEGIN, client->player_id, now_ns());
+  }
+  client_send(client, buf, len);
+  if (trace_fanout) {
+    trace_point(TRACE_SEND_END, client->player_id, now_ns());
+  }
+}
+
+// Função para refazer as listas de destinatários de cada nível. Deve ser
+// chamada com o lock adquirido
+void rebuild_tiers() {
+  memset(tier_counts, 0, sizeof(tier_counts));
+
+  for (int i = 0; i < PLAYERS_MAX; i++) {
+    if (!clients[i].active) {
+      continue;
     }
+    int tier = clients[i].tier;
+    if (is_flight_phase && clients[i].has_bet && !clients[i].has_cashed_out) {
+      tier = TIER_FULL;
+    }
+    tier_members[tier][tier_counts[tier]++] = i;
+  }
+  tiers_dirty = 0;
+}
+
+// Função para decidir se um nível recebe o tick: o reduzido a cada
+// TIER_REDUCED_EVERY ticks, o de marcos a cada TIER_MILESTONE_STEP
+// centésimos do multiplicador e o de rodadas nunca
+int tier_due(int tier, uint32_t tick, float value) {
+  if (tier == TIER_FULL) {
+    return 1;
   }
+  if (tier == TIER_REDUCED) {
+    return tick % TIER_REDUCED_EVERY == 0;
+  }
+  if (tier == TIER_MILESTONES) {
+    // O 1.00x abre todo voo e não é um marco
+    long hundredths = lroundf(value * 100);
+    return hundredths > 100 && hundredths % TIER_MILESTONE_STEP == 0;
+  }
+  return 0;
+}
+
+// Função para trocar o nível de assinatura do cliente, pedida com uma
+// mensagem "subscribe" com o nível em value
+void apply_subscription(client_info *client, float value) {
+  // O valor vem do cliente: NaN ou fora do intervalo não pode ser convertido
+  if (!isfinite(value) || value < 0 || value >= TIERS_COUNT) {
+    return;
+  }
+  int tier = value;
+
+  pthread_mutex_lock(&lock);
+  tier_subscribers += (tier != TIER_FULL) - (client->tier != TIER_FULL);
+  client->tier = tier;
+  tiers_dirty = 1;
   pthread_mutex_unlock(&lock);
 }
 
-// Função para informar aos clientes que o servidor fechou a sua execução
-void shutdown_server(int signal) {
+// Função de handler do SIGINT: apenas pede o encerramento à thread principal
+void request_shutdown(int signal) { shutdown_requested = 1; }
+
+// Função para informar aos clientes que o servidor fechou a sua execução,
+// chamada pela thread principal após o pedido de encerramento
+void shutdown_server() {
   aviator_msg aviator_message;
   server_running = 0;
 
@@ -512,23 +1424,31 @@ void shutdown_server(int signal) {
 
   // Fechando todos os sockets
   pthread_mutex_lock(&lock);
-  for (int i = 0; i < PLAYERS_MAX; i++) {
+  for (int i = 0; i < SLOTS_MAX; i++) {
     if (clients[i].active) {
       clients[i].active = 0;
-      close(clients[i].socket_conn);
+      client_close(&clients[i]);
     }
   }
   pthread_mutex_unlock(&lock);
 
+  capture_stop();
+  trace_stop();
+  print_metrics();
   printf("Encerrando o servidor.\n");
-  close(server_socket);
-  exit(0);
+  if (shm_path != NULL) {
+    unlink(shm_path);
+  }
 }
 
 // Função genérica para realizar o log dos eventos do servidor
 void logger(const char *event, int player_id, float multiplier, float explosion,
             int num_players, float total_bet, float bet, float payout,
             float player_profit, float house_profit) {
+  if (!log_enabled) {
+    return;
+  }
+
   printf("event=%s", event);
 
   if (player_id == -1) {
@@ -572,3 +1492,2376 @@ void logger(const char *event, int player_id, float multiplier, float explosion,
   printf("\n");
   fflush(stdout);
 }
+
+// Função para interpretar as opções opcionais passadas após os argumentos
+// obrigatórios do servidor
+void parse_options(int argc, char *argv[], int first) {
+  for (int i = first; i < argc; i++) {
+    if (strcmp(argv[i], "-spectate") == 0 && i + 1 < argc) {
+      // Formato esperado: <grupo multicast>:<porta>
+      char group[INET_ADDRSTRLEN];
+      char *sep = strrchr(argv[++i], ':');
+      if (sep == NULL || sep - argv[i] >= INET_ADDRSTRLEN) {
+        endWithErrorMessage("Invalid spectator group (expected group:port)");
+      }
+      memcpy(group, argv[i], sep - argv[i]);
+      group[sep - argv[i]] = '\0';
+
+      int group_port = atoi(sep + 1);
+      if (group_port <= 0 || group_port > 65535) {
+        endWithErrorMessage("Invalid spectator port");
+      }
+
+      memset(&spectator_group, 0, sizeof(spectator_group));
+      spectator_group.sin_family = AF_INET;
+      spectator_group.sin_port = htons(group_port);
+      if (inet_pton(AF_INET, group, &spectator_group.sin_addr) <= 0 ||
+          !IN_MULTICAST(ntohl(spectator_group.sin_addr.s_addr))) {
+        endWithErrorMessage("Invalid spectator multicast group");
+      }
+      spectator_enabled = 1;
+    } else if (strcmp(argv[i], "-spectate-if") == 0 && i + 1 < argc) {
+      // Interface de saída do multicast (ex: 127.0.0.1 para testes locais)
+      if (inet_pton(AF_INET, argv[++i], &spectator_if) <= 0) {
+        endWithErrorMessage("Invalid spectator interface");
+      }
+    } else if (strncmp(argv[i], "-cpu-", 5) == 0 && i + 1 < argc) {
+      // Núcleos por papel: -cpu-game 2 -cpu-io 3-5 -cpu-bg 0,1
+      int role = strcmp(argv[i], "-cpu-game") == 0 ? ROLE_GAME
+                 : strcmp(argv[i], "-cpu-io") == 0 ? ROLE_IO
+                 : strcmp(argv[i], "-cpu-bg") == 0 ? ROLE_BACKGROUND
+                                                   : -1;
+      if (role < 0) {
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      parse_placement(argv[++i], &placements[role], 0);
+    } else if (strncmp(argv[i], "-sched-", 7) == 0 && i + 1 < argc) {
+      // Política por papel: -sched-game fifo:50, rr:10 ou other
+      int role = strcmp(argv[i], "-sched-game") == 0 ? ROLE_GAME
+                 : strcmp(argv[i], "-sched-io") == 0 ? ROLE_IO
+                 : strcmp(argv[i], "-sched-bg") == 0 ? ROLE_BACKGROUND
+                                                     : -1;
+      if (role < 0) {
+        fprintf(stderr, "Unknown option: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      parse_placement(argv[++i], &placements[role], 1);
+    } else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) {
+      // Arquivo onde a sessão será capturada para replay
+      capture_path = argv[++i];
+    } else if (strcmp(argv[i], "-cluster-listen") == 0 && i + 1 < argc) {
+      // Porta onde o motor do jogo aceita os relays
+      cluster_port = atoi(argv[++i]);
+      if (cluster_port <= 0 || cluster_port > 65535) {
+        endWithErrorMessage("Invalid cluster port");
+      }
+    } else if (strcmp(argv[i], "-relay") == 0 && i + 1 < argc) {
+      // Endereço do motor no formato <host>:<porta>
+      relay_upstream = argv[++i];
+      relay_mode = 1;
+    } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+      // Arquivo do trace de latência do fan-out e do cashout
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "-shm") == 0 && i + 1 < argc) {
+      // Caminho do socket Unix usado para o handshake da memória compartilhada
+      shm_path = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Função para criar o socket UDP do feed de espectadores. O mesmo socket
+// publica no grupo multicast e atende pedidos de retransmissão via unicast
+void spectator_start(int port) {
+  struct sockaddr_in addr;
+  unsigned char ttl = 1;
+  unsigned char loop = 1;
+
+  spectator_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (spectator_socket < 0) {
+    endWithErrorMessage("Error creating spectator socket");
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(spectator_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    endWithErrorMessage("Error binding spectator socket");
+  }
+
+  // TTL 1 mantém o feed na rede local; o loop permite espectadores na mesma
+  // máquina do servidor
+  setsockopt(spectator_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+             sizeof(ttl));
+  setsockopt(spectator_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+             sizeof(loop));
+  if (spectator_if.s_addr != htonl(INADDR_ANY)) {
+    if (setsockopt(spectator_socket, IPPROTO_IP, IP_MULTICAST_IF,
+                   &spectator_if, sizeof(spectator_if)) < 0) {
+      endWithErrorMessage("Error setting spectator interface");
+    }
+  }
+}
+
+// Função para publicar um evento da rodada no feed de espectadores. Cada
+// evento é enviado uma única vez ao grupo e guardado no backlog para
+// retransmissões
+void spectator_publish(const char *type, float value) {
+  spectator_msg message;
+
+  if (!spectator_enabled) {
+    return;
+  }
+
+  memset(&message, 0, sizeof(spectator_msg));
+  strcpy(message.type, type);
+  message.value = value;
+  message.round_id = round_id;
+  message.phase = is_flight_phase ? PHASE_FLIGHT
+                  : is_bet_phase  ? PHASE_BET
+                                  : PHASE_WAIT;
+
+  pthread_mutex_lock(&spectator_lock);
+  message.seq = ++spectator_seq;
+  spectator_backlog[message.seq % SPECTATOR_BACKLOG] = message;
+  pthread_mutex_unlock(&spectator_lock);
+
+  sendto(spectator_socket, &message, sizeof(spectator_msg), 0,
+         (struct sockaddr *)&spectator_group, sizeof(spectator_group));
+}
+
+// Função de handler para pedidos de retransmissão dos espectadores. Caso as
+// mensagens pedidas ainda estejam no backlog elas são reenviadas, senão o
+// espectador recebe um snapshot do estado atual da rodada
+void *handle_spectator_requests(void *arg) {
+  spectator_msg request;
+  spectator_msg replies[SPECTATOR_RESEND_MAX];
+  struct sockaddr_in peer;
+  socklen_t peer_len;
+
+  thread_setup(ROLE_BACKGROUND, "spectator");
+
+  while (server_running) {
+    peer_len = sizeof(peer);
+    ssize_t received = recvfrom(spectator_socket, &request,
+                                sizeof(spectator_msg), 0,
+                                (struct sockaddr *)&peer, &peer_len);
+    if (received != sizeof(spectator_msg) ||
+        strncmp(request.type, "resend", STR_LEN) != 0) {
+      continue;
+    }
+
+    int count = 0;
+    pthread_mutex_lock(&spectator_lock);
+    uint32_t oldest = spectator_seq > SPECTATOR_BACKLOG
+                          ? spectator_seq - SPECTATOR_BACKLOG + 1
+                          : 1;
+    if (request.seq >= oldest && request.seq <= spectator_seq &&
+        spectator_seq - request.seq < SPECTATOR_RESEND_MAX) {
+      for (uint32_t seq = request.seq; seq <= spectator_seq; seq++) {
+        replies[count++] = spectator_backlog[seq % SPECTATOR_BACKLOG];
+      }
+    } else if (spectator_seq > 0) {
+      // Lacuna grande demais: o espectador se ressincroniza pelo snapshot
+      replies[0] = spectator_backlog[spectator_seq % SPECTATOR_BACKLOG];
+      strcpy(replies[0].type, "snapshot");
+      count = 1;
+    }
+    pthread_mutex_unlock(&spectator_lock);
+
+    for (int i = 0; i < count; i++) {
+      sendto(spectator_socket, &replies[i], sizeof(spectator_msg), 0,
+             (struct sockaddr *)&peer, peer_len);
+    }
+  }
+  return NULL;
+}
+
+// Função para ocupar um espaço livre do jogo com um novo cliente. Deve ser
+// chamada com o lock adquirido. Retorna o índice ocupado ou -1 caso o jogo
+// esteja cheio
+int claim_slot(int socket_conn, const transport_ops *transport,
+               void *transport_ctx) {
+  int available_idx = claim_slot_in(0, PLAYERS_MAX, socket_conn, transport,
+                                    transport_ctx, next_user_id);
+  if (available_idx != -1) {
+    next_user_id++;
+  }
+
+  return available_idx;
+}
+
+// Função para ocupar um espaço livre entre first e last (exclusive) com o id
+// informado. Os espaços a partir de PLAYERS_MAX são dos jogadores remotos,
+// conectados aos relays, e o id deles é definido pelo relay
+int claim_slot_in(int first, int last, int socket_conn,
+                  const transport_ops *transport, void *transport_ctx,
+                  int player_id) {
+  int available_idx = -1;
+  for (int i = first; i < last; i++) {
+    if (!clients[i].active) {
+      available_idx = i;
+      break;
+    }
+  }
+
+  if (available_idx != -1) {
+    clients[available_idx].socket_conn = socket_conn;
+    clients[available_idx].player_id = player_id;
+    clients[available_idx].profit = 0;
+    clients[available_idx].current_bet = 0;
+    clients[available_idx].has_bet = 0;
+    clients[available_idx].has_cashed_out = 0;
+    clients[available_idx].transport = transport;
+    clients[available_idx].transport_ctx = transport_ctx;
+    clients[available_idx].last_activity_ns = now_ns();
+    clients[available_idx].last_refill_ns =
+        clients[available_idx].last_activity_ns;
+    clients[available_idx].tokens = RATE_LIMIT_BURST;
+    clients[available_idx].rate_violations = 0;
+    clients[available_idx].send_drops = 0;
+    clients[available_idx].evict_reason = NULL;
+    clients[available_idx].profit_changed = 0;
+    clients[available_idx].tier = TIER_FULL;
+    clients[available_idx].active = 1;
+    tiers_dirty = 1;
+    leaderboard_insert(available_idx);
+    capture_event(CAPTURE_JOIN, player_id, 0);
+  }
+
+  return available_idx;
+}
+
+// Função para registrar um novo cliente conectado, iniciando a sua thread.
+// Retorna o índice ocupado ou -1 caso o jogo esteja cheio
+int register_client(int socket_conn, const transport_ops *transport,
+                    void *transport_ctx) {
+  pthread_mutex_lock(&lock);
+  int available_idx = claim_slot(socket_conn, transport, transport_ctx);
+  int player_id = available_idx != -1 ? clients[available_idx].player_id : 0;
+  pthread_mutex_unlock(&lock);
+
+  if (available_idx == -1) {
+    return -1;
+  }
+
+  // O motor passa a conhecer o jogador antes de qualquer mensagem dele. O
+  // quadro é enfileirado fora do lock do jogo, que não espera pelo enlace
+  if (relay_mode) {
+    relay_forward(CLUSTER_JOIN, player_id, NULL, 0);
+  }
+
+  // Invocação da função do jogo, sem bloquear a thread de conexões
+  pthread_create(&clients[available_idx].client_thread, NULL, handle_client,
+                 &clients[available_idx]);
+
+  return available_idx;
+}
+
+// Funções de acesso ao transporte do cliente. Os envios nunca bloqueiam: se
+// o cliente não consome as mensagens elas são descartadas e, persistindo, a
+// conexão é derrubada para não segurar o lock do jogo
+ssize_t client_send(client_info *client, const void *buf, size_t len) {
+  if (client->evict_reason != NULL) {
+    return -1;
+  }
+
+  ssize_t sent = client->transport->send(client, buf, len);
+  if (sent == (ssize_t)len) {
+    atomic_store(&client->send_drops, 0);
+    return sent;
+  }
+
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    atomic_fetch_add(&counters.dropped_sends, 1);
+    if (atomic_fetch_add(&client->send_drops, 1) + 1 < SLOW_DROPS_MAX) {
+      return sent;
+    }
+    mark_for_eviction(client, "slow");
+  } else {
+    // Escrita parcial corrompe o fluxo de mensagens, ou a conexão falhou
+    mark_for_eviction(client, sent < 0 ? "error" : "slow");
+  }
+
+  return sent;
+}
+
+ssize_t client_recv(client_info *client, void *buf, size_t len) {
+  return client->transport->recv(client, buf, len);
+}
+
+void client_close(client_info *client) { client->transport->close(client); }
+
+// Transporte TCP (padrão)
+ssize_t tcp_send(client_info *client, const void *buf, size_t len) {
+  return send(client->socket_conn, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+ssize_t tcp_recv(client_info *client, void *buf, size_t len) {
+  return recv(client->socket_conn, buf, len, 0);
+}
+
+void tcp_close(client_info *client) { close(client->socket_conn); }
+
+// Transporte por memória compartilhada. O envio nunca bloqueia o servidor:
+// se o anel do cliente estiver cheio a mensagem é descartada, assim como um
+// cliente lento não pode travar a thread do jogo
+ssize_t shm_send(client_info *client, const void *buf, size_t len) {
+  shm_transport_ctx *ctx = client->transport_ctx;
+
+  if (atomic_load(&ctx->closed)) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&ctx->send_lock);
+  ssize_t sent = shm_ring_write(&ctx->session->to_client, buf, len, 0);
+  pthread_mutex_unlock(&ctx->send_lock);
+
+  return sent;
+}
+
+// Sem dados no anel dentro do timeout, o socket do handshake indica se o
+// processo cliente ainda existe. Retorna 0 no fim da sessão e -1 com
+// errno = EAGAIN no timeout, como um socket com SO_RCVTIMEO
+ssize_t shm_recv(client_info *client, void *buf, size_t len) {
+  shm_transport_ctx *ctx = client->transport_ctx;
+  char probe;
+
+  if (atomic_load(&ctx->closed)) {
+    return 0;
+  }
+
+  ssize_t received =
+      shm_ring_read(&ctx->session->to_server, buf, len, RECV_TIMEOUT_MS);
+  if (received > 0) {
+    return received;
+  }
+
+  struct pollfd peer = {client->socket_conn, POLLIN, 0};
+  if (poll(&peer, 1, 0) > 0 &&
+      ((peer.revents & (POLLHUP | POLLERR)) ||
+       recv(client->socket_conn, &probe, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)) {
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+// A thread do cliente pode estar dormindo no futex do anel: o close apenas
+// marca a sessão como encerrada e a acorda. O shutdown do socket do
+// handshake avisa o processo cliente
+void shm_close(client_info *client) {
+  shm_transport_ctx *ctx = client->transport_ctx;
+
+  atomic_store(&ctx->closed, 1);
+  shm_futex(&ctx->session->to_server.head, FUTEX_WAKE, 1, NULL);
+  shutdown(client->socket_conn, SHUT_RDWR);
+}
+
+// O segmento e o socket Unix do handshake, mantido aberto durante a sessão
+// para que o fim do processo cliente seja percebido, são liberados pela
+// thread do cliente
+void shm_release(int socket_conn, void *transport_ctx) {
+  shm_transport_ctx *ctx = transport_ctx;
+
+  munmap(ctx->session, sizeof(shm_session));
+  pthread_mutex_destroy(&ctx->send_lock);
+  free(ctx);
+  close(socket_conn);
+}
+
+// Função para criar o socket Unix onde os clientes locais pedem uma sessão
+// de memória compartilhada
+void shm_start(const char *path) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    endWithErrorMessage("Shared memory socket path too long");
+  }
+
+  shm_listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (shm_listen_socket < 0) {
+    endWithErrorMessage("Error creating shared memory socket");
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (bind(shm_listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    endWithErrorMessage("Error binding shared memory socket");
+  }
+
+  if (listen(shm_listen_socket, PLAYERS_MAX) < 0) {
+    endWithErrorMessage("Error while listening in the shared memory socket");
+  }
+}
+
+// Função de handler para as conexões locais: cada cliente recebe um segmento
+// memfd com os dois anéis da sua sessão via SCM_RIGHTS
+void *handle_shm_clients(void *arg) {
+  thread_setup(ROLE_IO, "shm-accept");
+
+  while (server_running) {
+    int conn = accept(shm_listen_socket, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+
+    int memfd = memfd_create("aviator-session", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(shm_session)) < 0) {
+      perror("Error creating shared memory session");
+      if (memfd >= 0) {
+        close(memfd);
+      }
+      close(conn);
+      continue;
+    }
+
+    shm_session *session = mmap(NULL, sizeof(shm_session),
+                                PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (session == MAP_FAILED) {
+      perror("Error mapping shared memory session");
+      close(memfd);
+      close(conn);
+      continue;
+    }
+    shm_ring_init(&session->to_client);
+    shm_ring_init(&session->to_server);
+
+    // Enviando o descritor do segmento para o cliente
+    char payload = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&payload, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    int sent = sendmsg(conn, &msg, 0);
+    close(memfd);
+    if (sent < 0) {
+      munmap(session, sizeof(shm_session));
+      close(conn);
+      continue;
+    }
+
+    shm_transport_ctx *ctx = malloc(sizeof(shm_transport_ctx));
+    ctx->session = session;
+    pthread_mutex_init(&ctx->send_lock, NULL);
+    atomic_init(&ctx->closed, 0);
+
+    if (register_client(conn, &shm_transport, ctx) < 0) {
+      printf("Max number of players reached.\n");
+      munmap(session, sizeof(shm_session));
+      pthread_mutex_destroy(&ctx->send_lock);
+      free(ctx);
+      close(conn);
+    }
+  }
+  return NULL;
+}
+
+// Transporte descartável usado pelos clientes virtuais do replay
+ssize_t null_send(client_info *client, const void *buf, size_t len) {
+  return len;
+}
+
+ssize_t null_recv(client_info *client, void *buf, size_t len) { return 0; }
+
+void null_close(client_info *client) {}
+
+// Transporte dos jogadores conectados a um relay. Cada envio vira um quadro
+// DIRECT no enlace; falhas do enlace são tratadas pela thread do enlace, que
+// remove todos os jogadores do relay de uma vez
+ssize_t relay_send(client_info *client, const void *buf, size_t len) {
+  relay_link *link = client->transport_ctx;
+
+  cluster_send(link, CLUSTER_DIRECT, client->player_id, buf, len);
+  atomic_fetch_add(&counters.cluster_directs, 1);
+
+  return len;
+}
+
+// As mensagens dos jogadores remotos chegam pela thread do enlace
+ssize_t relay_recv(client_info *client, void *buf, size_t len) { return 0; }
+
+// A conexão do jogador pertence ao relay, que a encerra do seu lado
+void relay_close(client_info *client) {}
+
+// Função para escrever um buffer inteiro no enlace. Retorna -1 caso o enlace
+// tenha falhado ou o outro lado não tenha consumido dentro do timeout
+int cluster_write(int socket_conn, const void *buf, size_t len) {
+  size_t sent = 0;
+
+  while (sent < len) {
+    ssize_t n = send(socket_conn, (const char *)buf + sent, len - sent,
+                     MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+// Função para ler exatamente len bytes do enlace. Retorna 0 no fim da
+// conexão ou quando o servidor está encerrando
+int cluster_read(int socket_conn, void *buf, size_t len) {
+  size_t received = 0;
+
+  while (received < len) {
+    ssize_t n = recv(socket_conn, (char *)buf + received, len - received, 0);
+    if (n > 0) {
+      received += n;
+      continue;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return 0;
+    }
+    if (!server_running) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Função para receber um quadro completo do enlace. O payload deve ter
+// espaço para CLUSTER_PAYLOAD_MAX bytes
+int cluster_recv_frame(int socket_conn, cluster_frame *frame, void *payload) {
+  if (!cluster_read(socket_conn, frame, sizeof(cluster_frame)) ||
+      frame->length > CLUSTER_PAYLOAD_MAX) {
+    return 0;
+  }
+
+  return frame->length == 0 ||
+         cluster_read(socket_conn, payload, frame->length);
+}
+
+// Função para enviar um quadro ao relay do enlace. Cabeçalho e payload saem
+// numa única escrita que nunca bloqueia, já que os envios acontecem com o
+// lock do jogo adquirido. Assim como um cliente lento, um relay que não
+// consome o enlace (buffer cheio ou escrita parcial) é derrubado e a sua
+// thread faz a limpeza
+int cluster_send(relay_link *link, int kind, int player_id, const void *buf,
+                 size_t len) {
+  char frame_buf[sizeof(cluster_frame) + CLUSTER_PAYLOAD_MAX];
+  cluster_frame frame = {kind, player_id, len};
+
+  if (len > CLUSTER_PAYLOAD_MAX) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  memcpy(frame_buf, &frame, sizeof(cluster_frame));
+  if (len > 0) {
+    memcpy(frame_buf + sizeof(cluster_frame), buf, len);
+  }
+
+  pthread_mutex_lock(&link->send_lock);
+  ssize_t sent = send(link->socket_conn, frame_buf, sizeof(cluster_frame) + len,
+                      MSG_DONTWAIT | MSG_NOSIGNAL);
+  pthread_mutex_unlock(&link->send_lock);
+
+  if (sent == (ssize_t)(sizeof(cluster_frame) + len)) {
+    return 0;
+  }
+
+  if (link->down_reason == NULL) {
+    link->down_reason =
+        sent >= 0 || errno == EAGAIN || errno == EWOULDBLOCK ? "slow" : "error";
+    shutdown(link->socket_conn, SHUT_RDWR);
+  }
+
+  return -1;
+}
+
+// Função para enviar uma mensagem de broadcast a todos os relays, uma cópia
+// por relay independente de quantos jogadores ele tenha. Deve ser chamada
+// com o lock adquirido
+void cluster_broadcast(const void *buf, size_t len) {
+  for (int i = 0; i < RELAYS_MAX; i++) {
+    if (relay_links[i].active) {
+      if (trace_fanout) {
+        trace_point(TRACE_SEND_BEGIN, -relay_links[i].relay_id, now_ns());
+      }
+      cluster_send(&relay_links[i], CLUSTER_BROADCAST, 0, buf, len);
+      if (trace_fanout) {
+        trace_point(TRACE_SEND_END, -relay_links[i].relay_id, now_ns());
+      }
+      atomic_fetch_add(&counters.cluster_broadcasts, 1);
+    }
+  }
+}
+
+// Função para configurar um enlace entre motor e relay: as mesmas proteções
+// das conexões de clientes, sem Nagle para que os ticks não atrasem e com um
+// buffer de envio maior, já que no motor o enlace leva o fluxo de vários
+// jogadores e é derrubado quando enche. O timeout de envio vale para os
+// lotes do relay, que são escritos por inteiro
+void configure_cluster_link(int socket_conn) {
+  int enable = 1;
+  int sndbuf = CLUSTER_SNDBUF;
+  struct timeval timeout = {CLUSTER_SEND_TIMEOUT_MS / 1000,
+                            (CLUSTER_SEND_TIMEOUT_MS % 1000) * 1000};
+
+  configure_tcp_client(socket_conn);
+  setsockopt(socket_conn, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  setsockopt(socket_conn, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  setsockopt(socket_conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Função para criar o socket onde o motor aceita os relays
+void cluster_start(int port) {
+  struct sockaddr_in addr;
+  int reuse = 1;
+
+  for (int i = 0; i < RELAYS_MAX; i++) {
+    pthread_mutex_init(&relay_links[i].send_lock, NULL);
+  }
+
+  cluster_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (cluster_socket < 0) {
+    endWithErrorMessage("Error creating cluster socket");
+  }
+  setsockopt(cluster_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(cluster_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    endWithErrorMessage("Error binding cluster socket");
+  }
+
+  if (listen(cluster_socket, RELAYS_MAX) < 0) {
+    endWithErrorMessage("Error while listening in the cluster socket");
+  }
+}
+
+// Função de handler para as conexões de relays. Cada relay recebe um id no
+// HELLO, que define o intervalo de ids dos seus jogadores
+void *handle_cluster_links(void *arg) {
+  thread_setup(ROLE_IO, "cluster-accept");
+
+  while (server_running) {
+    int conn = accept(cluster_socket, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    configure_cluster_link(conn);
+
+    // O HELLO sai antes do enlace ficar ativo, então é sempre o primeiro
+    // quadro recebido pelo relay
+    relay_link *link = NULL;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < RELAYS_MAX; i++) {
+      if (!relay_links[i].active) {
+        link = &relay_links[i];
+        link->socket_conn = conn;
+        link->relay_id = i + 1;
+        link->down_reason = NULL;
+        if (cluster_send(link, CLUSTER_HELLO, link->relay_id, NULL, 0) == 0) {
+          link->active = 1;
+        }
+        break;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (link == NULL || !link->active) {
+      if (link == NULL) {
+        printf("Max number of relays reached.\n");
+      }
+      close(conn);
+      continue;
+    }
+
+    pthread_create(&link->link_thread, NULL, handle_relay_link, link);
+  }
+  return NULL;
+}
+
+// Função de handler de um enlace com um relay: aplica as entradas, saídas e
+// mensagens dos jogadores remotos no motor, pelas mesmas funções usadas para
+// os clientes locais
+void *handle_relay_link(void *arg) {
+  relay_link *link = arg;
+  cluster_frame frame;
+  char *payload;
+  int departed[SLOTS_MAX];
+  int count = 0;
+
+  pthread_detach(pthread_self());
+  thread_setup(ROLE_IO, "relay-link");
+
+  // Sem o buffer o enlace é tratado como perdido
+  payload = thread_local_alloc(CLUSTER_PAYLOAD_MAX);
+
+  if (log_enabled) {
+    printf("event=relay_up | relay=%d\n", link->relay_id);
+    fflush(stdout);
+  }
+
+  while (payload != NULL && server_running &&
+         cluster_recv_frame(link->socket_conn, &frame, payload)) {
+    // Um relay só pode agir sobre os seus próprios jogadores, cujos ids
+    // ficam no intervalo definido pelo id entregue no HELLO
+    if (frame.player_id <= link->relay_id * RELAY_ID_SPAN ||
+        frame.player_id >= (link->relay_id + 1) * RELAY_ID_SPAN) {
+      continue;
+    }
+    client_info *client = find_client(frame.player_id);
+    if (client != NULL && client->transport_ctx != link) {
+      continue;
+    }
+
+    if (frame.kind == CLUSTER_JOIN && client == NULL) {
+      relay_link_join(link, frame.player_id);
+    } else if (frame.kind == CLUSTER_LEAVE && client != NULL) {
+      remove_client(frame.player_id);
+    } else if (frame.kind == CLUSTER_MESSAGE && client != NULL &&
+               frame.length == sizeof(aviator_msg)) {
+      aviator_msg aviator_message;
+      memcpy(&aviator_message, payload, sizeof(aviator_msg));
+      client->last_activity_ns = now_ns();
+
+      capture_message(client, &aviator_message);
+      thread_sample();
+      process_client_message(client, &aviator_message);
+    }
+  }
+
+  // Relay caiu: todos os seus jogadores saem do jogo
+  pthread_mutex_lock(&lock);
+  for (int i = PLAYERS_MAX; i < SLOTS_MAX; i++) {
+    if (clients[i].active && clients[i].transport_ctx == link) {
+      departed[count++] = clients[i].player_id;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < count; i++) {
+    remove_client(departed[i]);
+  }
+
+  pthread_mutex_lock(&lock);
+  link->active = 0;
+  close(link->socket_conn);
+  pthread_mutex_unlock(&lock);
+
+  if (log_enabled) {
+    printf("event=relay_down | relay=%d | players=%d | reason=%s\n",
+           link->relay_id, count,
+           link->down_reason ? link->down_reason : "eof");
+    fflush(stdout);
+  }
+
+  if (payload != NULL) {
+    thread_local_free(payload, CLUSTER_PAYLOAD_MAX);
+  }
+  thread_teardown();
+  return NULL;
+}
+
+// Função para registrar um jogador remoto, enviando a ele o mesmo contexto
+// que um cliente local recebe ao entrar
+void relay_link_join(relay_link *link, int player_id) {
+  aviator_msg aviator_message;
+
+  pthread_mutex_lock(&lock);
+  int available_idx = claim_slot_in(PLAYERS_MAX, SLOTS_MAX, -1,
+                                    &relay_transport, link, player_id);
+  pthread_mutex_unlock(&lock);
+
+  if (available_idx == -1) {
+    // Sem espaço: o bye faz o cliente sair e o relay liberar a conexão
+    printf("Max number of players reached.\n");
+    memset(&aviator_message, 0, sizeof(aviator_msg));
+    strcpy(aviator_message.type, "bye");
+    cluster_send(link, CLUSTER_DIRECT, player_id, &aviator_message,
+                 sizeof(aviator_msg));
+    return;
+  }
+
+  client_info *client = &clients[available_idx];
+  if (is_flight_phase) {
+    memset(&aviator_message, 0, sizeof(aviator_msg));
+    strcpy(aviator_message.type, "closed");
+    client_send(client, &aviator_message, sizeof(aviator_msg));
+  }
+  send_history(client, 0, HISTORY_SNAPSHOT);
+}
+
+// Função para encontrar o cliente ativo com o id informado
+client_info *find_client(int player_id) {
+  client_info *client = NULL;
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < SLOTS_MAX; i++) {
+    if (clients[i].active && clients[i].player_id == player_id) {
+      client = &clients[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return client;
+}
+
+// Função para conectar o relay ao motor (<host>:<porta>) e aguardar o HELLO
+// com o seu id
+void relay_connect(const char *upstream) {
+  char host[256];
+  struct addrinfo hints;
+  struct addrinfo *result;
+  cluster_frame frame;
+  char payload[CLUSTER_PAYLOAD_MAX];
+
+  const char *sep = strrchr(upstream, ':');
+  if (sep == NULL || sep == upstream || sep - upstream >= (long)sizeof(host)) {
+    endWithErrorMessage("Invalid relay upstream (expected host:port)");
+  }
+  memcpy(host, upstream, sep - upstream);
+  host[sep - upstream] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, sep + 1, &hints, &result) != 0) {
+    endWithErrorMessage("Could not resolve the relay upstream");
+  }
+
+  for (struct addrinfo *addr = result; addr != NULL; addr = addr->ai_next) {
+    upstream_socket = socket(addr->ai_family, addr->ai_socktype, 0);
+    if (upstream_socket < 0) {
+      continue;
+    }
+    if (connect(upstream_socket, addr->ai_addr, addr->ai_addrlen) == 0) {
+      break;
+    }
+    close(upstream_socket);
+    upstream_socket = -1;
+  }
+  freeaddrinfo(result);
+
+  if (upstream_socket < 0) {
+    endWithErrorMessage("Error connecting to the relay upstream");
+  }
+  configure_cluster_link(upstream_socket);
+
+  if (!cluster_recv_frame(upstream_socket, &frame, payload) ||
+      frame.kind != CLUSTER_HELLO) {
+    endWithErrorMessage("Relay upstream refused the connection");
+  }
+
+  // Intervalo de ids exclusivo do relay, sem coordenação com o motor
+  next_user_id = frame.player_id * RELAY_ID_SPAN + 1;
+  printf("Relay %d conectado ao motor em %s\n", frame.player_id, upstream);
+  fflush(stdout);
+}
+
+// Função para enfileirar um quadro para o motor. Os quadros de todos os
+// clientes do relay são acumulados e enviados juntos pela thread de flush,
+// ou antes disso caso o lote encha
+void relay_forward(int kind, int player_id, const void *buf, size_t len) {
+  cluster_frame frame = {kind, player_id, len};
+
+  pthread_mutex_lock(&relay_lock);
+  // Lote cheio: a thread de flush é acordada e libera o outro buffer
+  while (relay_batch_len + sizeof(cluster_frame) + len > RELAY_BATCH_SIZE) {
+    pthread_cond_signal(&relay_pending);
+    pthread_cond_wait(&relay_drained, &relay_lock);
+  }
+
+  if (relay_batch_len == 0) {
+    pthread_cond_signal(&relay_pending);
+  }
+
+  memcpy(relay_batch + relay_batch_len, &frame, sizeof(cluster_frame));
+  relay_batch_len += sizeof(cluster_frame);
+  if (len > 0) {
+    memcpy(relay_batch + relay_batch_len, buf, len);
+    relay_batch_len += len;
+  }
+  atomic_fetch_add(&counters.relay_frames, 1);
+  pthread_mutex_unlock(&relay_lock);
+}
+
+// Função para enviar o lote acumulado ao motor, chamada apenas pela thread
+// de flush. Os buffers são trocados sob o relay_lock e a escrita, que pode
+// esperar pelo motor, acontece fora dele: os clientes seguem enfileirando
+// no outro buffer
+void relay_flush() {
+  pthread_mutex_lock(&relay_lock);
+  char *batch = relay_batch;
+  size_t len = relay_batch_len;
+  relay_batch =
+      batch == relay_batches[0] ? relay_batches[1] : relay_batches[0];
+  relay_batch_len = 0;
+  pthread_cond_broadcast(&relay_drained);
+  pthread_mutex_unlock(&relay_lock);
+
+  if (len == 0) {
+    return;
+  }
+
+  // Falha no enlace: a thread do upstream percebe o fim e encerra o relay
+  if (cluster_write(upstream_socket, batch, len) < 0) {
+    shutdown(upstream_socket, SHUT_RDWR);
+  }
+  atomic_fetch_add(&counters.relay_flushes, 1);
+}
+
+// Função de handler para o envio dos lotes. A thread dorme enquanto não há
+// nada a enviar; o primeiro quadro abre uma janela de RELAY_FLUSH_US para
+// juntar os demais, o que limita o atraso extra de uma aposta ou cashout
+void *handle_relay_flush(void *arg) {
+  thread_setup(ROLE_IO, "relay-flush");
+
+  while (server_running) {
+    pthread_mutex_lock(&relay_lock);
+    while (relay_batch_len == 0 && server_running) {
+      pthread_cond_wait(&relay_pending, &relay_lock);
+    }
+    pthread_mutex_unlock(&relay_lock);
+
+    usleep(RELAY_FLUSH_US);
+    relay_flush();
+  }
+  return NULL;
+}
+
+// Função de handler para os quadros vindos do motor: o broadcast é repassado
+// a todos os clientes locais e as mensagens diretas ao seu destinatário
+void *handle_upstream(void *arg) {
+  cluster_frame frame;
+  char *payload;
+
+  thread_setup(ROLE_IO, "upstream");
+
+  payload = thread_local_alloc(CLUSTER_PAYLOAD_MAX);
+  if (payload == NULL) {
+    endWithErrorMessage("Error allocating the upstream buffer");
+  }
+
+  while (server_running &&
+         cluster_recv_frame(upstream_socket, &frame, payload)) {
+    thread_sample();
+
+    aviator_msg event;
+    memset(&event, 0, sizeof(aviator_msg));
+    memcpy(&event, payload,
+           frame.length < sizeof(aviator_msg) ? frame.length
+                                              : sizeof(aviator_msg));
+
+    if (frame.kind == CLUSTER_BROADCAST &&
+        strncmp(event.type, "multiplier", STR_LEN) == 0) {
+      // No relay o tick começa com a chegada do multiplicador do motor e
+      // os níveis de assinatura são aplicados aos clientes locais
+      trace_tick_begin();
+      send_tick(&event);
+      flight_ticks++;
+      trace_tick_end();
+    } else if (frame.kind == CLUSTER_BROADCAST) {
+      relay_follow_round(&event);
+      send_all_buffer(payload, frame.length);
+    } else if (frame.kind == CLUSTER_DIRECT) {
+      pthread_mutex_lock(&lock);
+      for (int i = 0; i < PLAYERS_MAX; i++) {
+        if (clients[i].active && clients[i].player_id == frame.player_id) {
+          // A aposta aceita pelo motor é espelhada para manter o fluxo
+          // completo durante o voo. A confirmação fica no relay, o cliente
+          // já exibiu a sua aposta
+          if (strncmp(event.type, "bet", STR_LEN) == 0) {
+            clients[i].has_bet = 1;
+            clients[i].current_bet = event.value;
+            tiers_dirty = 1;
+            break;
+          }
+          // Após o saque o cliente volta ao seu nível de assinatura. No
+          // relay o saque é aplicado quando o motor devolve o payout
+          int is_payout = strncmp(event.type, "payout", STR_LEN) == 0;
+          if (is_payout) {
+            trace_point(TRACE_CASHOUT_APPLIED, frame.player_id, now_ns());
+            clients[i].has_cashed_out = 1;
+            tiers_dirty = 1;
+          }
+          client_send(&clients[i], payload, frame.length);
+          if (is_payout) {
+            trace_point(TRACE_PAYOUT_SENT, frame.player_id, now_ns());
+          }
+          break;
+        }
+      }
+      pthread_mutex_unlock(&lock);
+    }
+  }
+
+  // Sem o motor não há jogo: os clientes são avisados e o relay encerra
+  if (server_running) {
+    printf("Conexão com o motor perdida\n");
+    pthread_kill(main_thread, SIGINT);
+  }
+  return NULL;
+}
+
+// Função para acompanhar a fase da rodada pelos eventos do motor. O relay
+// não decide nada, apenas mantém o necessário para saber quem tem uma aposta
+// viva durante o voo
+void relay_follow_round(const aviator_msg *event) {
+  if (strncmp(event->type, "start", STR_LEN) == 0 && !is_bet_phase) {
+    pthread_mutex_lock(&lock);
+    round_id = event->player_id;
+    for (int i = 0; i < PLAYERS_MAX; i++) {
+      clients[i].has_bet = 0;
+      clients[i].has_cashed_out = 0;
+      clients[i].current_bet = 0;
+    }
+    is_bet_phase = 1;
+    is_flight_phase = 0;
+    pthread_mutex_unlock(&lock);
+  } else if (strncmp(event->type, "closed", STR_LEN) == 0) {
+    pthread_mutex_lock(&lock);
+    round_id = event->player_id;
+    is_bet_phase = 0;
+    is_flight_phase = 1;
+    flight_ticks = 0;
+    tiers_dirty = 1;
+    pthread_mutex_unlock(&lock);
+  } else if (strncmp(event->type, "explode", STR_LEN) == 0) {
+    is_flight_phase = 0;
+  }
+}
+
+// Função para tratar uma mensagem de um cliente do relay: o bye e a
+// assinatura são resolvidos localmente (a saída chega ao motor como LEAVE) e
+// o restante vai ao motor
+int relay_client_message(client_info *client, aviator_msg *aviator_message) {
+  if (strcmp(aviator_message->type, "bye") == 0) {
+    remove_client(client->player_id);
+    return 0;
+  }
+
+  if (strcmp(aviator_message->type, "subscribe") == 0) {
+    apply_subscription(client, aviator_message->value);
+    return 1;
+  }
+
+  // O recebimento é o instante em que a mensagem ficou completa no relay
+  if (strcmp(aviator_message->type, "cashout") == 0 && is_flight_phase &&
+      client->has_bet && !client->has_cashed_out) {
+    trace_point(TRACE_CASHOUT_RECV, client->player_id,
+                client->last_activity_ns);
+  }
+
+  relay_forward(CLUSTER_MESSAGE, client->player_id, aviator_message,
+                sizeof(aviator_msg));
+  return 1;
+}
+
+// Função para iniciar a captura da sessão no arquivo informado
+void capture_start(const char *path) {
+  capture_header header;
+
+  capture_file = fopen(path, "wb");
+  if (capture_file == NULL) {
+    endWithErrorMessage("Error opening capture file");
+  }
+
+  memset(&header, 0, sizeof(capture_header));
+  strcpy(header.magic, CAPTURE_MAGIC);
+  header.record_size = sizeof(capture_record);
+  fwrite(&header, sizeof(capture_header), 1, capture_file);
+
+  capture_started_ns = now_ns();
+}
+
+// Função para registrar um evento na captura junto com o contexto da rodada
+void capture_event(int kind, int player_id, float value) {
+  capture_record record;
+
+  if (capture_file == NULL) {
+    return;
+  }
+
+  memset(&record, 0, sizeof(capture_record));
+  record.kind = kind;
+  record.player_id = player_id;
+  record.message.value = value;
+  record.round_id = round_id;
+  record.mult = mult;
+  record.phase = is_flight_phase ? PHASE_FLIGHT
+                 : is_bet_phase  ? PHASE_BET
+                                 : PHASE_WAIT;
+
+  // O timestamp é tirado dentro do lock para que o arquivo fique ordenado
+  pthread_mutex_lock(&capture_lock);
+  record.timestamp_ns = now_ns() - capture_started_ns;
+  fwrite(&record, sizeof(capture_record), 1, capture_file);
+  pthread_mutex_unlock(&capture_lock);
+}
+
+// Função para registrar uma mensagem recebida de um cliente
+void capture_message(client_info *client, aviator_msg *message) {
+  capture_record record;
+
+  if (capture_file == NULL) {
+    return;
+  }
+
+  memset(&record, 0, sizeof(capture_record));
+  record.kind = CAPTURE_MESSAGE;
+  record.player_id = client->player_id;
+  record.message = *message;
+  record.round_id = round_id;
+  record.mult = mult;
+  record.phase = is_flight_phase ? PHASE_FLIGHT
+                 : is_bet_phase  ? PHASE_BET
+                                 : PHASE_WAIT;
+
+  pthread_mutex_lock(&capture_lock);
+  record.timestamp_ns = now_ns() - capture_started_ns;
+  fwrite(&record, sizeof(capture_record), 1, capture_file);
+  pthread_mutex_unlock(&capture_lock);
+}
+
+// Função para finalizar a captura, garantindo que tudo foi escrito
+void capture_stop() {
+  pthread_mutex_lock(&capture_lock);
+  if (capture_file != NULL) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+// Função para reproduzir uma sessão capturada no motor do jogo. Os clientes
+// são virtuais (transporte nulo) e as mensagens passam pelas mesmas funções
+// de aposta, cashout e liquidação do servidor. Em tempo real os intervalos
+// originais são respeitados, senão tudo é processado o mais rápido possível
+int run_replay(const char *path, int realtime) {
+  capture_header header;
+  capture_record record;
+  struct timespec deadline;
+  uint64_t *message_latencies = NULL;
+  uint64_t *settle_latencies = NULL;
+  size_t message_count = 0;
+  size_t settle_count = 0;
+  size_t capacity = 0;
+  size_t records = 0;
+  int mismatches = 0;
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    endWithErrorMessage("Error opening capture file");
+  }
+
+  if (fread(&header, sizeof(capture_header), 1, file) != 1 ||
+      strcmp(header.magic, CAPTURE_MAGIC) != 0 ||
+      header.record_size != sizeof(capture_record)) {
+    fprintf(stderr, "Invalid capture file: %s\n", path);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  // O log de eventos dominaria o tempo medido
+  log_enabled = 0;
+
+  uint64_t started = now_ns();
+  while (fread(&record, sizeof(capture_record), 1, file) == 1) {
+    records++;
+
+    if (realtime) {
+      uint64_t target = started + record.timestamp_ns;
+      deadline.tv_sec = target / 1000000000ull;
+      deadline.tv_nsec = target % 1000000000ull;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+
+    if (message_count == capacity || settle_count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      message_latencies = realloc(message_latencies, capacity * sizeof(uint64_t));
+      settle_latencies = realloc(settle_latencies, capacity * sizeof(uint64_t));
+    }
+
+    if (record.kind == CAPTURE_JOIN) {
+      pthread_mutex_lock(&lock);
+      claim_slot_in(0, SLOTS_MAX, -1, &null_transport, NULL,
+                    record.player_id);
+      pthread_mutex_unlock(&lock);
+    } else if (record.kind == CAPTURE_LEAVE) {
+      remove_client(record.player_id);
+    } else if (record.kind == CAPTURE_ROUND_START) {
+      prepare_round();
+      round_id = record.round_id;
+    } else if (record.kind == CAPTURE_CLOSED) {
+      // A explosão é recalculada a partir das apostas reproduzidas, o que
+      // confirma que o replay chegou ao mesmo estado da sessão original
+      if (close_bets() != record.message.value) {
+        mismatches++;
+      }
+    } else if (record.kind == CAPTURE_EXPLODE) {
+      mult = record.mult;
+      uint64_t begin = now_ns();
+      explode_round(record.message.value);
+      settle_latencies[settle_count++] = now_ns() - begin;
+    } else if (record.kind == CAPTURE_MESSAGE) {
+      client_info *client = NULL;
+      for (int i = 0; i < SLOTS_MAX; i++) {
+        if (clients[i].active && clients[i].player_id == record.player_id) {
+          client = &clients[i];
+          break;
+        }
+      }
+      if (client == NULL) {
+        continue;
+      }
+
+      mult = record.mult;
+      uint64_t begin = now_ns();
+      process_client_message(client, &record.message);
+      message_latencies[message_count++] = now_ns() - begin;
+    }
+  }
+  uint64_t elapsed = now_ns() - started;
+  fclose(file);
+
+  qsort(message_latencies, message_count, sizeof(uint64_t), compare_u64);
+  qsort(settle_latencies, settle_count, sizeof(uint64_t), compare_u64);
+
+  printf("replay=%s | mode=%s | records=%zu | rounds=%zu | messages=%zu\n",
+         path, realtime ? "realtime" : "fast", records, settle_count,
+         message_count);
+  printf("elapsed=%.3fs | throughput=%.0f records/s\n", elapsed / 1e9,
+         records / (elapsed / 1e9));
+  if (message_count > 0) {
+    printf("message_latency_us | p50=%.2f | p99=%.2f | max=%.2f\n",
+           message_latencies[message_count / 2] / 1000.0,
+           message_latencies[(size_t)(message_count * 0.99)] / 1000.0,
+           message_latencies[message_count - 1] / 1000.0);
+  }
+  if (settle_count > 0) {
+    printf("settle_latency_us | p50=%.2f | p99=%.2f | max=%.2f\n",
+           settle_latencies[settle_count / 2] / 1000.0,
+           settle_latencies[(size_t)(settle_count * 0.99)] / 1000.0,
+           settle_latencies[settle_count - 1] / 1000.0);
+  }
+  printf("house_profit=%.2f | explosion_mismatches=%d\n", house_profit,
+         mismatches);
+
+  free(message_latencies);
+  free(settle_latencies);
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Função para obter o tempo monotônico em nanossegundos
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Função para que os apostadores sintéticos ajam de acordo com a fase da
+// rodada: cada um decide uma vez por rodada se aposta e em qual
+// multiplicador irá sacar, usando as mesmas mensagens de um cliente real
+void simulate_bettors() {
+  aviator_msg message;
+
+  for (int i = 0; i < PLAYERS_MAX; i++) {
+    if (!clients[i].active) {
+      continue;
+    }
+
+    if (is_bet_phase && sim_decided_round[i] != round_id) {
+      sim_decided_round[i] = round_id;
+      if (rand_r(&sim_seed) >= SIM_BET_PROBABILITY * RAND_MAX) {
+        continue;
+      }
+
+      // Alvo de saque com cauda exponencial: a maioria saca cedo
+      double u = (rand_r(&sim_seed) + 1.0) / (RAND_MAX + 2.0);
+      sim_targets[i] = 1.0 - log(u) * 0.5;
+
+      memset(&message, 0, sizeof(aviator_msg));
+      strcpy(message.type, "bet");
+      message.value = 1 + rand_r(&sim_seed) % SIM_BET_MAX;
+      process_client_message(&clients[i], &message);
+    } else if (is_flight_phase && clients[i].has_bet &&
+               !clients[i].has_cashed_out && mult >= sim_targets[i]) {
+      memset(&message, 0, sizeof(aviator_msg));
+      strcpy(message.type, "cashout");
+      process_client_message(&clients[i], &message);
+    }
+  }
+}
+
+// Função executada por cada processo worker da simulação. Cada worker tem o
+// seu próprio estado global do jogo (processos separados), então o motor
+// roda sem nenhuma alteração e sem disputa de locks entre os workers
+void sim_worker(int worker, uint64_t rounds, int players, FILE *rounds_csv,
+                sim_summary *summary) {
+  memset(summary, 0, sizeof(sim_summary));
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < players; i++) {
+    claim_slot(-1, &null_transport, NULL);
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (uint64_t r = 0; r < rounds; r++) {
+    double house_before = house_profit;
+
+    float explosion = play_round();
+    game_sleep(5000000);
+
+    // O estado das apostas só é limpo na abertura da próxima rodada
+    int bettors = 0;
+    int cashouts = 0;
+    float staked = 0;
+    for (int i = 0; i < PLAYERS_MAX; i++) {
+      if (clients[i].active && clients[i].has_bet) {
+        bettors++;
+        staked += clients[i].current_bet;
+        cashouts += clients[i].has_cashed_out;
+      }
+    }
+
+    int bin = (int)((explosion - 1.0) * 100.0 + 0.5);
+    if (bin < 0) {
+      bin = 0;
+    } else if (bin >= SIM_HISTOGRAM_BINS) {
+      bin = SIM_HISTOGRAM_BINS - 1;
+    }
+
+    summary->rounds++;
+    summary->bets += bettors;
+    summary->cashouts += cashouts;
+    summary->total_staked += staked;
+    summary->house_profit += house_profit - house_before;
+    summary->explosion_sum += explosion;
+    summary->histogram[bin]++;
+    if (explosion > summary->explosion_max) {
+      summary->explosion_max = explosion;
+    }
+
+    if (rounds_csv != NULL) {
+      fprintf(rounds_csv, "%d,%u,%d,%.2f,%.2f,%d,%.2f\n", worker, round_id,
+              bettors, staked, explosion, cashouts,
+              house_profit - house_before);
+    }
+  }
+
+  summary->virtual_us = virtual_clock_us;
+}
+
+// Função para executar a simulação de Monte Carlo da economia do jogo,
+// distribuindo as rodadas entre processos workers e agregando os resultados
+int run_simulation(int argc, char *argv[]) {
+  uint64_t rounds = strtoull(argv[2], NULL, 10);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = cpus > 0 ? cpus : 1;
+  int players = PLAYERS_MAX;
+  unsigned int seed = time(NULL);
+  const char *csv_path = NULL;
+  sim_summary total;
+  sim_summary partial;
+
+  if (rounds == 0) {
+    endWithErrorMessage("Invalid number of rounds");
+  }
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-players") == 0 && i + 1 < argc) {
+      players = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-rounds-csv") == 0 && i + 1 < argc) {
+      csv_path = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (workers <= 0 || players <= 0 || players > PLAYERS_MAX) {
+    endWithErrorMessage("Invalid number of workers or players");
+  }
+
+  simulation_mode = 1;
+  log_enabled = 0;
+
+  // Cada worker escreve o seu resumo num pipe próprio
+  int pipes[workers][2];
+  pid_t pids[workers];
+  uint64_t started = now_ns();
+
+  for (int w = 0; w < workers; w++) {
+    if (pipe(pipes[w]) < 0) {
+      endWithErrorMessage("Error creating simulation pipe");
+    }
+
+    pids[w] = fork();
+    if (pids[w] < 0) {
+      endWithErrorMessage("Error creating simulation worker");
+    }
+
+    if (pids[w] == 0) {
+      FILE *rounds_csv = NULL;
+      uint64_t share = rounds / workers + (w < (int)(rounds % workers));
+
+      close(pipes[w][0]);
+      sim_seed = seed + w;
+
+      // Per-round em um arquivo por worker, evitando coordenação na escrita
+      if (csv_path != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s.%d", csv_path, w);
+        rounds_csv = fopen(path, "w");
+        if (rounds_csv == NULL) {
+          endWithErrorMessage("Error opening rounds csv");
+        }
+        fprintf(rounds_csv,
+                "worker,round,players,staked,explosion,cashouts,house_delta\n");
+      }
+
+      sim_worker(w, share, players, rounds_csv, &partial);
+
+      if (rounds_csv != NULL) {
+        fclose(rounds_csv);
+      }
+      write(pipes[w][1], &partial, sizeof(sim_summary));
+      _exit(EXIT_SUCCESS);
+    }
+    close(pipes[w][1]);
+  }
+
+  memset(&total, 0, sizeof(sim_summary));
+  for (int w = 0; w < workers; w++) {
+    size_t received = 0;
+    while (received < sizeof(sim_summary)) {
+      ssize_t n = read(pipes[w][0], (char *)&partial + received,
+                       sizeof(sim_summary) - received);
+      if (n <= 0) {
+        endWithErrorMessage("Simulation worker failed");
+      }
+      received += n;
+    }
+    close(pipes[w][0]);
+    waitpid(pids[w], NULL, 0);
+
+    total.rounds += partial.rounds;
+    total.bets += partial.bets;
+    total.cashouts += partial.cashouts;
+    total.total_staked += partial.total_staked;
+    total.house_profit += partial.house_profit;
+    total.explosion_sum += partial.explosion_sum;
+    total.virtual_us += partial.virtual_us;
+    if (partial.explosion_max > total.explosion_max) {
+      total.explosion_max = partial.explosion_max;
+    }
+    for (int b = 0; b < SIM_HISTOGRAM_BINS; b++) {
+      total.histogram[b] += partial.histogram[b];
+    }
+  }
+  double elapsed = (now_ns() - started) / 1e9;
+
+  // Percentis da explosão a partir do histograma agregado
+  float percentiles[] = {0.5, 0.9, 0.99};
+  float explosion_at[3] = {0, 0, 0};
+  for (int p = 0; p < 3; p++) {
+    uint64_t target = (uint64_t)(total.rounds * percentiles[p]);
+    uint64_t seen = 0;
+    for (int b = 0; b < SIM_HISTOGRAM_BINS; b++) {
+      seen += total.histogram[b];
+      if (seen > target) {
+        explosion_at[p] = 1.0 + b / 100.0;
+        break;
+      }
+    }
+  }
+
+  printf("sim | workers=%d | players=%d | seed=%u\n", workers, players, seed);
+  printf("rounds=%llu | wall=%.2fs | rounds_per_min=%.0f | simulated=%.1fh\n",
+         (unsigned long long)total.rounds, elapsed,
+         total.rounds / elapsed * 60.0, total.virtual_us / 3.6e9);
+  printf("explosion | mean=%.2f | p50=%.2f | p90=%.2f | p99=%.2f | "
+         "max=%.2f\n",
+         total.explosion_sum / total.rounds, explosion_at[0], explosion_at[1],
+         explosion_at[2], total.explosion_max);
+  printf("bets=%llu | cashout_rate=%.3f | staked=%.2f | house_profit=%.2f | "
+         "house_edge=%.4f\n",
+         (unsigned long long)total.bets,
+         total.bets ? (double)total.cashouts / total.bets : 0,
+         total.total_staked, total.house_profit,
+         total.total_staked > 0 ? total.house_profit / total.total_staked : 0);
+
+  return EXIT_SUCCESS;
+}
+
+// Função para configurar as conexões TCP dos clientes: keepalive detecta
+// pares mortos mesmo sem tráfego, TCP_USER_TIMEOUT derruba conexões
+// meio-abertas com dados sem confirmação e o timeout de recebimento permite
+// checar a inatividade periodicamente
+void configure_tcp_client(int socket_conn) {
+  int enable = 1;
+  int idle = KEEPALIVE_IDLE_S;
+  int interval = KEEPALIVE_INTERVAL_S;
+  int count = KEEPALIVE_COUNT;
+  unsigned int user_timeout = USER_TIMEOUT_MS;
+  struct timeval timeout = {RECV_TIMEOUT_MS / 1000,
+                            (RECV_TIMEOUT_MS % 1000) * 1000};
+
+  setsockopt(socket_conn, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(socket_conn, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(socket_conn, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+             sizeof(interval));
+  setsockopt(socket_conn, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  setsockopt(socket_conn, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+             sizeof(user_timeout));
+  setsockopt(socket_conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Função para receber uma mensagem completa do cliente. Retorna 1 com a
+// mensagem, 0 no fim da conexão, -1 em caso de erro e -2 quando o cliente
+// passou do tempo máximo de inatividade
+int recv_message(client_info *client, aviator_msg *message) {
+  size_t received = 0;
+
+  while (received < sizeof(aviator_msg)) {
+    ssize_t n = client_recv(client, (char *)message + received,
+                            sizeof(aviator_msg) - received);
+    if (n > 0) {
+      received += n;
+      continue;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return -1;
+    }
+
+    // Timeout do recebimento: conexão derrubada por outra thread, servidor
+    // encerrando ou cliente inativo por tempo demais
+    if (client->evict_reason != NULL || !server_running) {
+      return 0;
+    }
+    if (now_ns() - client->last_activity_ns >
+        (uint64_t)IDLE_TIMEOUT_S * 1000000000ull) {
+      return -2;
+    }
+  }
+
+  client->last_activity_ns = now_ns();
+  return 1;
+}
+
+// Token bucket de mensagens recebidas por conexão. Retorna 0 quando a
+// mensagem deve ser descartada
+int allow_message(client_info *client) {
+  uint64_t now = client->last_activity_ns;
+
+  client->tokens +=
+      (now - client->last_refill_ns) / 1e9 * (float)RATE_LIMIT_PER_S;
+  if (client->tokens > RATE_LIMIT_BURST) {
+    client->tokens = RATE_LIMIT_BURST;
+  }
+  client->last_refill_ns = now;
+
+  if (client->tokens < 1) {
+    client->rate_violations++;
+    atomic_fetch_add(&counters.rate_limited, 1);
+    return 0;
+  }
+
+  client->tokens -= 1;
+  client->rate_violations = 0;
+  return 1;
+}
+
+// Função para derrubar a conexão de um cliente a partir de outra thread (ex:
+// thread do jogo com o lock adquirido). A thread do cliente percebe o fim da
+// conexão e faz a remoção
+void mark_for_eviction(client_info *client, const char *reason) {
+  const char *expected = NULL;
+  if (atomic_compare_exchange_strong(&client->evict_reason, &expected,
+                                     reason)) {
+    shutdown(client->socket_conn, SHUT_RDWR);
+  }
+}
+
+// Função para remover um cliente problemático, contabilizando o motivo
+void evict_client(client_info *client, const char *reason) {
+  // Já removido por outra thread, que encerrou a conexão
+  if (!client->active) {
+    return;
+  }
+
+  if (strcmp(reason, "eof") == 0) {
+    atomic_fetch_add(&counters.evicted_eof, 1);
+  } else if (strcmp(reason, "idle") == 0) {
+    atomic_fetch_add(&counters.evicted_idle, 1);
+  } else if (strcmp(reason, "flood") == 0) {
+    atomic_fetch_add(&counters.evicted_flood, 1);
+  } else if (strcmp(reason, "slow") == 0) {
+    atomic_fetch_add(&counters.evicted_slow, 1);
+  } else {
+    atomic_fetch_add(&counters.evicted_error, 1);
+  }
+
+  if (log_enabled) {
+    printf("event=evict | id=%d | reason=%s\n", client->player_id, reason);
+    fflush(stdout);
+  }
+
+  remove_client(client->player_id);
+}
+
+// Handler do SIGUSR1: as métricas são exibidas pela thread do jogo ao fim da
+// rodada, fora do contexto do sinal
+void request_metrics(int signal) { metrics_requested = 1; }
+
+// Função para exibir os contadores de proteção do servidor
+void print_metrics() {
+  printf("metrics | evicted_eof=%lu | evicted_error=%lu | evicted_idle=%lu | "
+         "evicted_flood=%lu | evicted_slow=%lu | rate_limited=%lu | "
+         "dropped_sends=%lu\n",
+         atomic_load(&counters.evicted_eof),
+         atomic_load(&counters.evicted_error),
+         atomic_load(&counters.evicted_idle),
+         atomic_load(&counters.evicted_flood),
+         atomic_load(&counters.evicted_slow),
+         atomic_load(&counters.rate_limited),
+         atomic_load(&counters.dropped_sends));
+
+  // Ticks do multiplicador enviados e poupados pelos níveis de assinatura
+  printf("tiers | tick_sends=%lu | tick_skips=%lu\n",
+         atomic_load(&counters.tick_sends), atomic_load(&counters.tick_skips));
+
+  // Registros perdidos quando a escrita do trace não acompanhou a thread
+  if (trace_path != NULL) {
+    printf("trace | dropped=%lu\n", atomic_load(&counters.trace_dropped));
+  }
+
+  // Tráfego do enlace do cluster, no motor e nos relays
+  if (cluster_port > 0 || relay_mode) {
+    int relays = 0;
+    for (int i = 0; i < RELAYS_MAX; i++) {
+      relays += relay_links[i].active;
+    }
+    printf("cluster | relays=%d | broadcasts=%lu | directs=%lu | "
+           "relay_frames=%lu | relay_flushes=%lu\n",
+           relays, atomic_load(&counters.cluster_broadcasts),
+           atomic_load(&counters.cluster_directs),
+           atomic_load(&counters.relay_frames),
+           atomic_load(&counters.relay_flushes));
+  }
+
+  // Tempo de CPU e migrações de cada thread viva, e o acumulado das threads
+  // de clientes que já terminaram
+  pthread_mutex_lock(&threads_lock);
+  for (int i = 0; i < THREADS_MAX; i++) {
+    thread_stats *stats = thread_registry[i];
+    struct timespec cpu;
+    if (stats == NULL || clock_gettime(stats->clock, &cpu) < 0) {
+      continue;
+    }
+    printf("thread | name=%s | role=%s | tid=%d | cpu=%d | cpu_ms=%.1f | "
+           "migrations=%lu\n",
+           stats->name, role_names[stats->role], stats->tid, stats->last_cpu,
+           cpu.tv_sec * 1e3 + cpu.tv_nsec / 1e6, thread_migrations(stats));
+  }
+  for (int role = 0; role < ROLES_COUNT; role++) {
+    if (retired_threads[role] > 0) {
+      printf("thread | retired=%lu | role=%s | cpu_ms=%.1f\n",
+             retired_threads[role], role_names[role],
+             retired_cpu_ns[role] / 1e6);
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+  fflush(stdout);
+}
+
+// Função para interpretar uma lista de núcleos ("0-3,6") ou uma política de
+// escalonamento ("fifo:50", "rr:10", "other")
+void parse_placement(const char *value, thread_placement *placement,
+                     int is_sched) {
+  if (is_sched) {
+    const char *sep = strchr(value, ':');
+    size_t len = sep ? (size_t)(sep - value) : strlen(value);
+
+    if (strncmp(value, "fifo", len) == 0 && len == 4) {
+      placement->policy = SCHED_FIFO;
+    } else if (strncmp(value, "rr", len) == 0 && len == 2) {
+      placement->policy = SCHED_RR;
+    } else if (strncmp(value, "other", len) == 0 && len == 5) {
+      placement->policy = SCHED_OTHER;
+    } else {
+      endWithErrorMessage("Invalid scheduling policy (fifo, rr or other)");
+    }
+
+    placement->priority = sep ? atoi(sep + 1) : 0;
+    if (placement->priority < sched_get_priority_min(placement->policy) ||
+        placement->priority > sched_get_priority_max(placement->policy)) {
+      endWithErrorMessage("Invalid scheduling priority for the policy");
+    }
+    placement->has_sched = 1;
+    return;
+  }
+
+  CPU_ZERO(&placement->cpus);
+  const char *cursor = value;
+  while (*cursor) {
+    char *end;
+    long first = strtol(cursor, &end, 10);
+    long last = first;
+    if (end == cursor) {
+      endWithErrorMessage("Invalid cpu list");
+    }
+    if (*end == '-') {
+      cursor = end + 1;
+      last = strtol(cursor, &end, 10);
+      if (end == cursor) {
+        endWithErrorMessage("Invalid cpu list");
+      }
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      endWithErrorMessage("Invalid cpu range");
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &placement->cpus);
+    }
+    cursor = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      endWithErrorMessage("Invalid cpu list");
+    }
+  }
+  placement->has_cpus = 1;
+}
+
+// Função chamada no início de cada thread do servidor: aplica a afinidade e
+// a política do seu papel, fixa a alocação de memória no nó local e
+// registra a thread nas métricas
+void thread_setup(int role, const char *name) {
+  thread_placement *placement = &placements[role];
+
+  // Renomear a thread principal mudaria o nome do processo
+  if (gettid() != getpid()) {
+    pthread_setname_np(pthread_self(), name);
+  }
+
+  if (placement->has_cpus &&
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                             &placement->cpus) != 0) {
+    fprintf(stderr, "Could not pin %s thread to the chosen cpus\n", name);
+  }
+
+  if (placement->has_sched) {
+    struct sched_param param = {.sched_priority = placement->priority};
+    int err = pthread_setschedparam(pthread_self(), placement->policy, &param);
+    if (err != 0) {
+      fprintf(stderr, "Could not set scheduling policy of %s thread: %s\n",
+              name, strerror(err));
+    }
+  }
+
+  // Depois do pinning, as páginas tocadas por essa thread passam a ser
+  // alocadas no nó NUMA em que ela roda
+  if (placement->has_cpus) {
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+  }
+
+  thread_stats *stats = thread_local_alloc(sizeof(thread_stats));
+  if (stats == NULL) {
+    return;
+  }
+  strncpy(stats->name, name, sizeof(stats->name) - 1);
+  stats->role = role;
+  stats->tid = gettid();
+  stats->last_cpu = sched_getcpu();
+  pthread_getcpuclockid(pthread_self(), &stats->clock);
+
+  pthread_mutex_lock(&threads_lock);
+  for (int i = 0; i < THREADS_MAX; i++) {
+    if (thread_registry[i] == NULL) {
+      thread_registry[i] = stats;
+      self_stats = stats;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  if (self_stats == NULL) {
+    thread_local_free(stats, sizeof(thread_stats));
+    return;
+  }
+
+  // O buffer de trace também é tocado primeiro pela própria thread
+  if (trace_file != NULL) {
+    self_trace = thread_local_alloc(sizeof(trace_buffer));
+    stats->trace = self_trace;
+  }
+}
+
+// Função chamada ao fim das threads de clientes e da escrita do trace,
+// acumulando o seu tempo de CPU no total do papel
+void thread_teardown() {
+  struct timespec cpu;
+
+  if (self_stats == NULL) {
+    return;
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+  pthread_mutex_lock(&threads_lock);
+  if (self_trace != NULL) {
+    trace_retire(self_trace);
+    self_trace = NULL;
+  }
+  for (int i = 0; i < THREADS_MAX; i++) {
+    if (thread_registry[i] == self_stats) {
+      thread_registry[i] = NULL;
+      break;
+    }
+  }
+  retired_threads[self_stats->role]++;
+  retired_cpu_ns[self_stats->role] +=
+      (uint64_t)cpu.tv_sec * 1000000000ull + cpu.tv_nsec;
+  pthread_mutex_unlock(&threads_lock);
+
+  thread_local_free(self_stats, sizeof(thread_stats));
+  self_stats = NULL;
+}
+
+// Função para amostrar o núcleo atual da thread, contando as trocas de
+// núcleo observadas nos pontos quentes (ticks e mensagens)
+void thread_sample() {
+  if (self_stats == NULL) {
+    return;
+  }
+
+  int cpu = sched_getcpu();
+  if (cpu != self_stats->last_cpu) {
+    self_stats->sampled_migrations++;
+    self_stats->last_cpu = cpu;
+  }
+}
+
+// Função para alocar um buffer da thread: as páginas são tocadas pela
+// própria thread após o pinning, ficando no seu nó NUMA (first touch)
+void *thread_local_alloc(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void thread_local_free(void *ptr, size_t size) { munmap(ptr, size); }
+
+// Função para obter as migrações de uma thread. O contador do escalonador
+// só existe em kernels com CONFIG_SCHED_DEBUG; sem ele é usada a contagem
+// amostrada pela própria thread
+uint64_t thread_migrations(thread_stats *stats) {
+  char path[64];
+  char line[256];
+  uint64_t migrations = stats->sampled_migrations;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/sched", stats->tid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return migrations;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, "se.nr_migrations", 16) == 0) {
+      char *value = strchr(line, ':');
+      if (value != NULL) {
+        migrations = strtoull(value + 1, NULL, 10);
+      }
+      break;
+    }
+  }
+  fclose(file);
+
+  return migrations;
+}
+
+// Ordem do ranking: maior profit primeiro, empates pelo menor id
+int rank_before(int a, int b) {
+  if (rank_nodes[a].profit != rank_nodes[b].profit) {
+    return rank_nodes[a].profit > rank_nodes[b].profit;
+  }
+  return rank_nodes[a].player_id < rank_nodes[b].player_id;
+}
+
+int rank_size(int node) { return node < 0 ? 0 : rank_nodes[node].size; }
+
+void rank_refresh(int node) {
+  rank_nodes[node].size =
+      1 + rank_size(rank_nodes[node].left) + rank_size(rank_nodes[node].right);
+}
+
+// Divide a árvore entre os nós que vêm antes de key e o restante
+void rank_split(int node, int key, int *before, int *after) {
+  if (node < 0) {
+    *before = -1;
+    *after = -1;
+    return;
+  }
+
+  if (rank_before(node, key)) {
+    rank_split(rank_nodes[node].right, key, &rank_nodes[node].right, after);
+    *before = node;
+  } else {
+    rank_split(rank_nodes[node].left, key, before, &rank_nodes[node].left);
+    *after = node;
+  }
+  rank_refresh(node);
+}
+
+// Junta duas árvores em que todos os nós de before vêm antes dos de after
+int rank_merge(int before, int after) {
+  if (before < 0) {
+    return after;
+  }
+  if (after < 0) {
+    return before;
+  }
+
+  if (rank_nodes[before].priority > rank_nodes[after].priority) {
+    rank_nodes[before].right = rank_merge(rank_nodes[before].right, after);
+    rank_refresh(before);
+    return before;
+  }
+  rank_nodes[after].left = rank_merge(before, rank_nodes[after].left);
+  rank_refresh(after);
+  return after;
+}
+
+int rank_remove(int node, int key) {
+  if (node == key) {
+    return rank_merge(rank_nodes[node].left, rank_nodes[node].right);
+  }
+
+  if (rank_before(key, node)) {
+    rank_nodes[node].left = rank_remove(rank_nodes[node].left, key);
+  } else {
+    rank_nodes[node].right = rank_remove(rank_nodes[node].right, key);
+  }
+  rank_refresh(node);
+  return node;
+}
+
+// Funções do ranking, todas chamadas com o lock adquirido
+void leaderboard_insert(int slot) {
+  int before;
+  int after;
+  rank_node *node = &rank_nodes[slot];
+
+  if (node->in_tree) {
+    return;
+  }
+
+  node->profit = clients[slot].profit;
+  node->player_id = clients[slot].player_id;
+  node->priority = (uint32_t)(slot + 1) * 2654435761u ^ node->player_id;
+  node->left = -1;
+  node->right = -1;
+  node->size = 1;
+  node->in_tree = 1;
+
+  rank_split(rank_root, slot, &before, &after);
+  rank_root = rank_merge(rank_merge(before, slot), after);
+}
+
+void leaderboard_erase(int slot) {
+  if (!rank_nodes[slot].in_tree) {
+    return;
+  }
+  rank_root = rank_remove(rank_root, slot);
+  rank_nodes[slot].in_tree = 0;
+}
+
+void leaderboard_update(int slot) {
+  leaderboard_erase(slot);
+  leaderboard_insert(slot);
+}
+
+// Posição (a partir de 1) do jogador no ranking
+int leaderboard_rank(int slot) {
+  int position = 0;
+  int node = rank_root;
+
+  if (!rank_nodes[slot].in_tree) {
+    return 0;
+  }
+
+  while (node >= 0) {
+    if (node == slot) {
+      return position + rank_size(rank_nodes[node].left) + 1;
+    }
+    if (rank_before(slot, node)) {
+      node = rank_nodes[node].left;
+    } else {
+      position += rank_size(rank_nodes[node].left) + 1;
+      node = rank_nodes[node].right;
+    }
+  }
+  return 0;
+}
+
+// Preenche os k primeiros do ranking, percorrendo a árvore em ordem
+int leaderboard_top(int k, int *slots) {
+  int stack[SLOTS_MAX];
+  int depth = 0;
+  int count = 0;
+  int node = rank_root;
+
+  while ((node >= 0 || depth > 0) && count < k) {
+    while (node >= 0) {
+      stack[depth++] = node;
+      node = rank_nodes[node].left;
+    }
+    node = stack[--depth];
+    slots[count++] = node;
+    node = rank_nodes[node].right;
+  }
+  return count;
+}
+
+// Função para enviar o top-K do ranking a todos ao fim da rodada, com uma
+// mensagem "top" por posição enviadas num único lote
+void broadcast_leaderboard() {
+  aviator_msg snapshot[LEADERBOARD_TOP_K];
+  int slots[LEADERBOARD_TOP_K];
+
+  pthread_mutex_lock(&lock);
+  int count = leaderboard_top(LEADERBOARD_TOP_K, slots);
+  memset(snapshot, 0, sizeof(snapshot));
+  for (int i = 0; i < count; i++) {
+    strcpy(snapshot[i].type, "top");
+    snapshot[i].player_id = rank_nodes[slots[i]].player_id;
+    snapshot[i].value = i + 1;
+    snapshot[i].player_profit = rank_nodes[slots[i]].profit;
+    snapshot[i].house_profit = house_profit;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (count > 0) {
+    send_all_buffer(snapshot, count * sizeof(aviator_msg));
+  }
+}
+
+// Função para guardar o resultado da rodada no anel de histórico. Chamada
+// apenas pela thread do jogo, sem locks
+void history_record(float explosion) {
+  uint32_t count = atomic_load_explicit(&history_count, memory_order_relaxed);
+  history_slot *slot = &history_ring[count % HISTORY_SIZE];
+  uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+  // Sequência ímpar indica escrita em andamento
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  slot->entry.round_id = round_id;
+  slot->entry.players = round_players;
+  slot->entry.explosion = explosion;
+  slot->entry.total_staked = round_staked;
+  slot->entry.house_delta = house_profit - round_house_start;
+
+  atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+  atomic_store_explicit(&history_count, count + 1, memory_order_release);
+}
+
+// Função para ler até max rodadas anteriores a before_round (0 para as mais
+// recentes), da mais nova para a mais antiga. Retorna quantas foram lidas
+int history_read(uint32_t before_round, int max, history_entry *out) {
+  uint32_t count = atomic_load_explicit(&history_count, memory_order_acquire);
+  uint32_t oldest = count > HISTORY_SIZE ? count - HISTORY_SIZE : 0;
+  int read = 0;
+
+  for (uint32_t index = count; index > oldest && read < max; index--) {
+    history_slot *slot = &history_ring[(index - 1) % HISTORY_SIZE];
+    history_entry copy;
+    uint32_t before;
+    uint32_t after;
+
+    do {
+      before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      copy = slot->entry;
+      atomic_thread_fence(memory_order_acquire);
+      after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    // O espaço pode ter sido sobrescrito por uma rodada mais nova
+    if (before_round != 0 && copy.round_id >= before_round) {
+      continue;
+    }
+    if (read > 0 && copy.round_id >= out[read - 1].round_id) {
+      break;
+    }
+    out[read++] = copy;
+  }
+
+  return read;
+}
+
+// Função para enviar um lote do histórico: uma mensagem "history" com a
+// quantidade de entradas em player_id, seguida das entradas
+void send_history(client_info *client, uint32_t before_round, int max) {
+  char buffer[sizeof(aviator_msg) + HISTORY_PAGE_MAX * sizeof(history_entry)];
+  aviator_msg *header = (aviator_msg *)buffer;
+  history_entry *entries = (history_entry *)(buffer + sizeof(aviator_msg));
+
+  int count = history_read(before_round, max, entries);
+
+  memset(header, 0, sizeof(aviator_msg));
+  strcpy(header->type, "history");
+  header->player_id = count;
+  header->value = count > 0 ? entries[count - 1].round_id : 0;
+
+  client_send(client, buffer,
+              sizeof(aviator_msg) + count * sizeof(history_entry));
+}
+
+// Função para iniciar o arquivo de trace, com o mesmo cabeçalho da captura
+void trace_start(const char *path) {
+  capture_header header;
+
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL) {
+    endWithErrorMessage("Error opening trace file");
+  }
+
+  memset(&header, 0, sizeof(capture_header));
+  strcpy(header.magic, TRACE_MAGIC);
+  header.record_size = sizeof(trace_record);
+  fwrite(&header, sizeof(capture_header), 1, trace_file);
+
+  pthread_create(&trace_writer, NULL, handle_trace_writer, NULL);
+}
+
+// Função para marcar uma etapa no buffer da própria thread, sem locks e sem
+// I/O. O writing indica ao trace_stop que a thread está no meio de uma marca
+void trace_point(int stage, int player_id, uint64_t timestamp_ns) {
+  if (self_trace == NULL) {
+    return;
+  }
+
+  atomic_store(&self_trace->writing, 1);
+  if (atomic_load(&trace_closed)) {
+    atomic_store(&self_trace->writing, 0);
+    return;
+  }
+
+  trace_half *half = &self_trace->halves[self_trace->current];
+  trace_record *record = &half->records[half->count];
+  record->timestamp_ns = timestamp_ns;
+  record->round_id = round_id;
+  record->tick = trace_tick;
+  record->stage = stage;
+  record->player_id = player_id;
+
+  if (++half->count == TRACE_BUFFER_RECORDS) {
+    trace_submit(self_trace);
+  }
+  atomic_store(&self_trace->writing, 0);
+}
+
+// Funções que delimitam o fan-out de um tick. Apenas a thread que faz o
+// fan-out marca os envios de cada cliente
+void trace_tick_begin() {
+  if (self_trace == NULL) {
+    return;
+  }
+  trace_tick++;
+  trace_fanout = 1;
+  trace_point(TRACE_TICK, -1, now_ns());
+}
+
+void trace_tick_end() {
+  if (!trace_fanout) {
+    return;
+  }
+  trace_point(TRACE_FANOUT_END, -1, now_ns());
+  trace_fanout = 0;
+}
+
+// Função para entregar a metade cheia à thread de escrita e seguir na outra.
+// Se a outra metade ainda não foi gravada, a escrita está atrasada e os
+// registros da metade cheia são descartados em vez de bloquear a thread
+void trace_submit(trace_buffer *buffer) {
+  trace_half *half = &buffer->halves[buffer->current];
+  trace_half *other = &buffer->halves[!buffer->current];
+
+  if (atomic_load(&other->queued)) {
+    atomic_fetch_add(&counters.trace_dropped, half->count);
+    half->count = 0;
+    return;
+  }
+
+  atomic_store(&half->queued, 1);
+  half->next = NULL;
+
+  pthread_mutex_lock(&trace_queue_lock);
+  if (trace_queue_tail != NULL) {
+    trace_queue_tail->next = half;
+  } else {
+    trace_queue_head = half;
+  }
+  trace_queue_tail = half;
+  pthread_cond_signal(&trace_queue_ready);
+  pthread_mutex_unlock(&trace_queue_lock);
+
+  buffer->current = !buffer->current;
+}
+
+// Função para gravar uma metade no arquivo e devolvê-la vazia à sua thread
+void trace_write(trace_half *half) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file != NULL && half->count > 0) {
+    fwrite(half->records, sizeof(trace_record), half->count, trace_file);
+  }
+  half->count = 0;
+  atomic_store(&half->queued, 0);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Função para retirar a próxima metade da fila de escrita, ou NULL se vazia
+trace_half *trace_dequeue() {
+  trace_half *half = trace_queue_head;
+  if (half != NULL) {
+    trace_queue_head = half->next;
+    if (trace_queue_head == NULL) {
+      trace_queue_tail = NULL;
+    }
+  }
+  return half;
+}
+
+// Função de handler da thread de escrita do trace: grava as metades cheias
+// fora das threads marcadas e termina ao esvaziar a fila após o trace_stop
+void *handle_trace_writer(void *arg) {
+  thread_setup(ROLE_BACKGROUND, "trace-writer");
+
+  while (1) {
+    pthread_mutex_lock(&trace_queue_lock);
+    while (trace_queue_head == NULL && !atomic_load(&trace_closed)) {
+      pthread_cond_wait(&trace_queue_ready, &trace_queue_lock);
+    }
+    trace_half *half = trace_dequeue();
+    pthread_mutex_unlock(&trace_queue_lock);
+
+    if (half == NULL) {
+      break;
+    }
+    trace_write(half);
+  }
+
+  thread_teardown();
+  return NULL;
+}
+
+// Função chamada no fim de uma thread marcada, com o threads_lock adquirido:
+// aguarda a escrita das metades na fila, grava a metade atual e libera o
+// buffer. Após o trace_stop as metades na fila são gravadas por ele, então
+// a memória fica até o fim do processo
+void trace_retire(trace_buffer *buffer) {
+  trace_half *halves = buffer->halves;
+
+  while (!atomic_load(&trace_closed) &&
+         (atomic_load(&halves[0].queued) || atomic_load(&halves[1].queued))) {
+    sched_yield();
+  }
+
+  trace_write(&halves[buffer->current]);
+  if (!atomic_load(&halves[0].queued) && !atomic_load(&halves[1].queued)) {
+    thread_local_free(buffer, sizeof(trace_buffer));
+  }
+}
+
+// Função para finalizar o trace. As threads param de marcar antes dos seus
+// buffers serem gravados: o trace_closed é visto por quem começa uma marca e
+// quem já estava no meio dela é aguardado pelo writing. O buffer da própria
+// thread que encerra não é aguardado, pois ela não está marcando
+void trace_stop() {
+  if (trace_file == NULL) {
+    return;
+  }
+
+  atomic_store(&trace_closed, 1);
+  pthread_mutex_lock(&trace_queue_lock);
+  pthread_cond_signal(&trace_queue_ready);
+  pthread_mutex_unlock(&trace_queue_lock);
+  pthread_join(trace_writer, NULL);
+
+  pthread_mutex_lock(&threads_lock);
+  for (int i = 0; i < THREADS_MAX; i++) {
+    trace_buffer *buffer =
+        thread_registry[i] != NULL ? thread_registry[i]->trace : NULL;
+    if (buffer == NULL) {
+      continue;
+    }
+    while (buffer != self_trace && atomic_load(&buffer->writing)) {
+      sched_yield();
+    }
+  }
+
+  // Metades entregues depois da saída da thread de escrita
+  pthread_mutex_lock(&trace_queue_lock);
+  trace_half *half;
+  while ((half = trace_dequeue()) != NULL) {
+    trace_write(half);
+  }
+  pthread_mutex_unlock(&trace_queue_lock);
+
+  for (int i = 0; i < THREADS_MAX; i++) {
+    if (thread_registry[i] != NULL && thread_registry[i]->trace != NULL) {
+      trace_buffer *buffer = thread_registry[i]->trace;
+      trace_write(&buffer->halves[buffer->current]);
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  pthread_mutex_lock(&trace_lock);
+  fclose(trace_file);
+  trace_file = NULL;
+  pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,146 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Anel lock-free de um produtor e um consumidor (SPSC) em memória
+// compartilhada. Cada sessão local possui dois anéis (servidor -> cliente e
+// cliente -> servidor) num mesmo segmento memfd, e as esperas usam futex
+// sobre os próprios índices do anel, então só há syscall quando o outro
+// lado está de fato dormindo
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_RING_SIZE 16384
+#define SHM_RING_SPINS 2000
+
+typedef struct {
+  // Índices em bytes, crescem indefinidamente e são reduzidos pela máscara
+  _Alignas(64) _Atomic uint32_t head;
+  _Atomic uint32_t consumer_waiting;
+  _Alignas(64) _Atomic uint32_t tail;
+  _Atomic uint32_t producer_waiting;
+  _Alignas(64) unsigned char data[SHM_RING_SIZE];
+} shm_ring;
+
+typedef struct {
+  shm_ring to_client;
+  shm_ring to_server;
+} shm_session;
+
+static inline long shm_futex(_Atomic uint32_t *addr, int op, uint32_t value,
+                             const struct timespec *timeout) {
+  // Sem FUTEX_PRIVATE_FLAG, pois o segmento é compartilhado entre processos
+  return syscall(SYS_futex, (uint32_t *)addr, op, value, timeout, NULL, 0);
+}
+
+static inline void shm_ring_init(shm_ring *ring) {
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->consumer_waiting, 0);
+  atomic_init(&ring->producer_waiting, 0);
+}
+
+// Espera até que o índice observado mude. Retorna 0 em caso de timeout
+static inline int shm_ring_wait(_Atomic uint32_t *index,
+                                _Atomic uint32_t *waiting, uint32_t observed,
+                                int timeout_ms) {
+  struct timespec timeout;
+
+  for (int i = 0; i < SHM_RING_SPINS; i++) {
+    if (atomic_load_explicit(index, memory_order_acquire) != observed) {
+      return 1;
+    }
+  }
+
+  atomic_store(waiting, 1);
+  if (atomic_load(index) == observed) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    shm_futex(index, FUTEX_WAIT, observed, timeout_ms < 0 ? NULL : &timeout);
+  }
+  atomic_store(waiting, 0);
+
+  return atomic_load_explicit(index, memory_order_acquire) != observed;
+}
+
+// Acorda o outro lado apenas se ele anunciou que iria dormir
+static inline void shm_ring_wake(_Atomic uint32_t *index,
+                                 _Atomic uint32_t *waiting) {
+  if (atomic_load(waiting)) {
+    shm_futex(index, FUTEX_WAKE, 1, NULL);
+  }
+}
+
+// Escreve a mensagem inteira ou nada. Com blocking = 0 retorna -1 e
+// errno = EAGAIN quando não há espaço, para que um consumidor lento não
+// trave o produtor
+static inline ssize_t shm_ring_write(shm_ring *ring, const void *buf,
+                                     size_t len, int blocking) {
+  if (len > SHM_RING_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  while (SHM_RING_SIZE - (head - tail) < len) {
+    if (!blocking) {
+      errno = EAGAIN;
+      return -1;
+    }
+    shm_ring_wait(&ring->tail, &ring->producer_waiting, tail, -1);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  }
+
+  uint32_t offset = head & (SHM_RING_SIZE - 1);
+  size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+  memcpy(&ring->data[offset], buf, first);
+  memcpy(&ring->data[0], (const unsigned char *)buf + first, len - first);
+
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  shm_ring_wake(&ring->head, &ring->consumer_waiting);
+
+  return len;
+}
+
+// Lê até len bytes, esperando por no máximo timeout_ms (-1 para sempre)
+// caso o anel esteja vazio. Retorna 0 em caso de timeout
+static inline ssize_t shm_ring_read(shm_ring *ring, void *buf, size_t len,
+                                    int timeout_ms) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (head == tail) {
+    if (!shm_ring_wait(&ring->head, &ring->consumer_waiting, head,
+                       timeout_ms)) {
+      return 0;
+    }
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  }
+
+  size_t available = head - tail;
+  if (len > available) {
+    len = available;
+  }
+
+  uint32_t offset = tail & (SHM_RING_SIZE - 1);
+  size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+  memcpy(buf, &ring->data[offset], first);
+  memcpy((unsigned char *)buf + first, &ring->data[0], len - first);
+
+  atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  shm_ring_wake(&ring->tail, &ring->producer_waiting);
+
+  return len;
+}
+
+#endif
@@ -0,0 +1,240 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STR_LEN 11
+#define RESEND_INTERVAL_MS 200
+
+// Fases da rodada publicadas no feed de espectadores
+typedef enum {
+  PHASE_WAIT,
+  PHASE_BET,
+  PHASE_FLIGHT,
+} RoundPhases;
+
+typedef struct {
+  uint32_t seq;
+  uint32_t round_id;
+  int32_t phase;
+  float value;
+  char type[STR_LEN];
+} spectator_msg;
+
+// Hoisting de funções
+void endWithErrorMessage(const char *message);
+void shutdown_spectator();
+void print_event(const spectator_msg *message, int recovered);
+long now_ms();
+
+// Variáveis globais para acompanhamento de estados
+int spectator_socket;
+int resend_socket;
+uint32_t lost_messages = 0;
+uint32_t recovered_messages = 0;
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_in group_addr;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in resend_addr;
+  struct ip_mreq membership;
+  socklen_t server_len;
+  spectator_msg message;
+  uint32_t next_seq = 0;
+  uint32_t resend_from = 0;
+  long last_resend = 0;
+  int reuse = 1;
+
+  // Uso: ./bin/spectator <grupo> <porta> [interface]
+  if (argc != 3 && argc != 4) {
+    endWithErrorMessage("Error: Invalid number of arguments");
+  }
+
+  signal(SIGINT, shutdown_spectator);
+
+  memset(&group_addr, 0, sizeof(group_addr));
+  group_addr.sin_family = AF_INET;
+  group_addr.sin_port = htons(atoi(argv[2]));
+  group_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  memset(&membership, 0, sizeof(membership));
+  if (inet_pton(AF_INET, argv[1], &membership.imr_multiaddr) <= 0) {
+    endWithErrorMessage("Invalid multicast group");
+  }
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (argc == 4 &&
+      inet_pton(AF_INET, argv[3], &membership.imr_interface) <= 0) {
+    endWithErrorMessage("Invalid interface address");
+  }
+
+  spectator_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (spectator_socket < 0) {
+    endWithErrorMessage("Error creating spectator socket");
+  }
+
+  // Vários espectadores podem escutar o mesmo grupo na mesma máquina
+  setsockopt(spectator_socket, SOL_SOCKET, SO_REUSEADDR, &reuse,
+             sizeof(reuse));
+
+  if (bind(spectator_socket, (struct sockaddr *)&group_addr,
+           sizeof(group_addr)) < 0) {
+    endWithErrorMessage("Error binding spectator socket");
+  }
+
+  if (setsockopt(spectator_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) < 0) {
+    endWithErrorMessage("Error joining multicast group");
+  }
+
+  // Pedidos de retransmissão usam um socket próprio numa porta efêmera: o
+  // unicast para uma porta compartilhada via SO_REUSEADDR só chega ao último
+  // espectador que a acoplou
+  resend_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (resend_socket < 0) {
+    endWithErrorMessage("Error creating resend socket");
+  }
+  memset(&resend_addr, 0, sizeof(resend_addr));
+  resend_addr.sin_family = AF_INET;
+  resend_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  resend_addr.sin_port = 0;
+  if (bind(resend_socket, (struct sockaddr *)&resend_addr,
+           sizeof(resend_addr)) < 0) {
+    endWithErrorMessage("Error binding resend socket");
+  }
+
+  printf("Assistindo ao feed em %s:%s\n", argv[1], argv[2]);
+  fflush(stdout);
+
+  while (1) {
+    // Respostas de retransmissão têm prioridade sobre o grupo, para que as
+    // mensagens recuperadas sejam aplicadas antes das novas
+    struct pollfd sources[2] = {{resend_socket, POLLIN, 0},
+                                {spectator_socket, POLLIN, 0}};
+    if (poll(sources, 2, -1) <= 0) {
+      continue;
+    }
+    int source =
+        (sources[0].revents & POLLIN) ? resend_socket : spectator_socket;
+
+    // O remetente do datagrama é o próprio servidor, que também atende os
+    // pedidos de retransmissão
+    server_len = sizeof(server_addr);
+    ssize_t received =
+        recvfrom(source, &message, sizeof(spectator_msg), 0,
+                 (struct sockaddr *)&server_addr, &server_len);
+    if (received != sizeof(spectator_msg)) {
+      continue;
+    }
+
+    if (strcmp(message.type, "snapshot") == 0) {
+      // Ressincronização completa, tudo antes do snapshot foi perdido
+      if (message.seq >= next_seq) {
+        lost_messages += message.seq - next_seq;
+        print_event(&message, 0);
+        next_seq = message.seq + 1;
+        resend_from = 0;
+      }
+      continue;
+    }
+
+    // Primeira mensagem recebida define o ponto de partida do feed
+    if (next_seq == 0) {
+      next_seq = message.seq;
+    }
+
+    if (message.seq < next_seq) {
+      // Duplicada ou retransmissão já aplicada
+      continue;
+    }
+
+    if (message.seq > next_seq) {
+      // Lacuna detectada: descarta a mensagem fora de ordem e pede ao
+      // servidor tudo a partir da primeira perdida, limitando a frequência
+      // dos pedidos
+      if (resend_from != next_seq ||
+          now_ms() - last_resend >= RESEND_INTERVAL_MS) {
+        spectator_msg request;
+        memset(&request, 0, sizeof(spectator_msg));
+        strcpy(request.type, "resend");
+        request.seq = next_seq;
+        sendto(resend_socket, &request, sizeof(spectator_msg), 0,
+               (struct sockaddr *)&server_addr, server_len);
+        resend_from = next_seq;
+        last_resend = now_ms();
+      }
+      continue;
+    }
+
+    print_event(&message, resend_from != 0);
+    if (resend_from != 0) {
+      recovered_messages++;
+    }
+    next_seq++;
+
+    // Retransmissão concluída quando voltamos a receber em ordem do grupo
+    if (resend_from != 0 && now_ms() - last_resend >= RESEND_INTERVAL_MS) {
+      resend_from = 0;
+    }
+  }
+}
+
+// Função para exibir um evento do feed de acordo com o seu tipo
+void print_event(const spectator_msg *message, int recovered) {
+  const char *tag = recovered ? " [recuperado]" : "";
+
+  if (strcmp(message->type, "start") == 0) {
+    printf("Rodada %u aberta! %.0f segundos para apostas%s\n",
+           message->round_id, message->value, tag);
+  } else if (strcmp(message->type, "closed") == 0) {
+    printf("Rodada %u: apostas encerradas%s\n", message->round_id, tag);
+  } else if (strcmp(message->type, "multiplier") == 0) {
+    printf("Rodada %u: multiplicador %.2fx%s\n", message->round_id,
+           message->value, tag);
+  } else if (strcmp(message->type, "explode") == 0) {
+    printf("Rodada %u: aviãozinho explodiu em %.2fx%s\n", message->round_id,
+           message->value, tag);
+  } else if (strcmp(message->type, "snapshot") == 0) {
+    if (message->phase == PHASE_FLIGHT) {
+      printf("Rodada %u em voo, multiplicador %.2fx (ressincronizado)\n",
+             message->round_id, message->value);
+    } else if (message->phase == PHASE_BET) {
+      printf("Rodada %u em apostas, %.0f segundos restantes "
+             "(ressincronizado)\n",
+             message->round_id, message->value);
+    } else {
+      printf("Rodada %u encerrada (ressincronizado)\n", message->round_id);
+    }
+  }
+  fflush(stdout);
+}
+
+// Função para obter o tempo monotônico em milissegundos
+long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Função para exibir erros genéricos e finalizar a execução do programa sem
+// tratamentos
+void endWithErrorMessage(const char *message) {
+  perror(message);
+  exit(EXIT_FAILURE);
+}
+
+// Função para encerrar o espectador exibindo as estatísticas do feed
+void shutdown_spectator() {
+  printf("\nMensagens perdidas: %u | recuperadas: %u\n", lost_messages,
+         recovered_messages);
+  close(spectator_socket);
+  close(resend_socket);
+  exit(0);
+}
@@ -0,0 +1,348 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "AVTRC1"
+#define DEFAULT_TOP 5
+
+// Etapas marcadas pelo servidor, na mesma ordem do enum do server.c
+typedef enum {
+  TRACE_TICK,
+  TRACE_SEND_BEGIN,
+  TRACE_SEND_END,
+  TRACE_FANOUT_END,
+  TRACE_CASHOUT_RECV,
+  TRACE_CASHOUT_APPLIED,
+  TRACE_PAYOUT_SENT,
+} TraceStages;
+
+typedef struct {
+  char magic[8];
+  uint32_t record_size;
+} trace_header;
+
+typedef struct {
+  uint64_t timestamp_ns;
+  uint32_t round_id;
+  uint32_t tick;
+  int32_t stage;
+  int32_t player_id;
+} trace_record;
+
+// Amostras de uma etapa, em nanossegundos
+typedef struct {
+  const char *name;
+  uint64_t *values;
+  size_t count;
+  size_t capacity;
+} stage_samples;
+
+// Acumulado dos envios de um cliente (ou relay) ao longo dos ticks
+typedef struct {
+  int32_t player_id;
+  uint64_t sends;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t slowest_ticks;
+} client_stats;
+
+// Tick com o seu fan-out total e o envio mais lento
+typedef struct {
+  uint32_t round_id;
+  uint32_t tick;
+  uint64_t fanout_ns;
+  int32_t slowest_player;
+  uint64_t slowest_ns;
+} tick_summary;
+
+// Cashout em andamento de um jogador
+typedef struct {
+  int32_t player_id;
+  uint64_t recv_ns;
+  uint64_t applied_ns;
+} pending_cashout;
+
+// Hoisting de funções
+void endWithErrorMessage(const char *message);
+void add_sample(stage_samples *samples, uint64_t value);
+void print_stage(stage_samples *samples);
+client_stats *find_client(int32_t player_id);
+pending_cashout *find_pending(int32_t player_id);
+void keep_slowest_tick(const tick_summary *tick);
+const char *client_name(int32_t player_id);
+int compare_u64(const void *a, const void *b);
+int compare_records(const void *a, const void *b);
+int compare_clients(const void *a, const void *b);
+
+// Variáveis globais do relatório
+client_stats *clients = NULL;
+size_t client_count = 0;
+pending_cashout *pending = NULL;
+size_t pending_count = 0;
+tick_summary *slowest_ticks = NULL;
+int top = DEFAULT_TOP;
+int slowest_count = 0;
+
+int main(int argc, char *argv[]) {
+  trace_header header;
+  trace_record *records = NULL;
+  size_t record_count = 0;
+  size_t capacity = 0;
+  stage_samples fanout = {.name = "tick_fanout"};
+  stage_samples sends = {.name = "client_send"};
+  stage_samples apply = {.name = "cashout_apply"};
+  stage_samples payout = {.name = "payout_send"};
+  stage_samples cashout = {.name = "cashout_total"};
+
+  // Uso: ./bin/trace_report <arquivo> [quantidade de ticks e clientes]
+  if (argc != 2 && argc != 3) {
+    endWithErrorMessage("Invalid number of arguments");
+  }
+  if (argc == 3) {
+    top = atoi(argv[2]);
+    if (top <= 0) {
+      endWithErrorMessage("Invalid number of entries");
+    }
+  }
+
+  FILE *file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    endWithErrorMessage("Error opening trace file");
+  }
+
+  if (fread(&header, sizeof(trace_header), 1, file) != 1 ||
+      strcmp(header.magic, TRACE_MAGIC) != 0 ||
+      header.record_size != sizeof(trace_record)) {
+    fprintf(stderr, "Invalid trace file: %s\n", argv[1]);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  while (1) {
+    if (record_count == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      records = realloc(records, capacity * sizeof(trace_record));
+    }
+    if (fread(&records[record_count], sizeof(trace_record), 1, file) != 1) {
+      break;
+    }
+    record_count++;
+  }
+  fclose(file);
+
+  // Cada thread grava o seu buffer separadamente, então o arquivo só fica
+  // em ordem depois de ordenado pelo tempo
+  qsort(records, record_count, sizeof(trace_record), compare_records);
+  slowest_ticks = calloc(top, sizeof(tick_summary));
+
+  tick_summary current;
+  uint64_t tick_started = 0;
+  uint64_t send_started = 0;
+  int in_tick = 0;
+  memset(&current, 0, sizeof(tick_summary));
+
+  for (size_t i = 0; i < record_count; i++) {
+    trace_record *record = &records[i];
+
+    if (record->stage == TRACE_TICK) {
+      memset(&current, 0, sizeof(tick_summary));
+      current.round_id = record->round_id;
+      current.tick = record->tick;
+      tick_started = record->timestamp_ns;
+      in_tick = 1;
+    } else if (record->stage == TRACE_SEND_BEGIN) {
+      send_started = record->timestamp_ns;
+    } else if (record->stage == TRACE_SEND_END && in_tick) {
+      uint64_t duration = record->timestamp_ns - send_started;
+      client_stats *client = find_client(record->player_id);
+
+      add_sample(&sends, duration);
+      client->sends++;
+      client->total_ns += duration;
+      if (duration > client->max_ns) {
+        client->max_ns = duration;
+      }
+      if (duration >= current.slowest_ns) {
+        current.slowest_ns = duration;
+        current.slowest_player = record->player_id;
+      }
+    } else if (record->stage == TRACE_FANOUT_END && in_tick) {
+      current.fanout_ns = record->timestamp_ns - tick_started;
+      add_sample(&fanout, current.fanout_ns);
+      if (current.slowest_player != 0) {
+        find_client(current.slowest_player)->slowest_ticks++;
+      }
+      keep_slowest_tick(&current);
+      in_tick = 0;
+    } else if (record->stage == TRACE_CASHOUT_RECV) {
+      pending_cashout *entry = find_pending(record->player_id);
+      entry->recv_ns = record->timestamp_ns;
+      entry->applied_ns = 0;
+    } else if (record->stage == TRACE_CASHOUT_APPLIED) {
+      pending_cashout *entry = find_pending(record->player_id);
+      if (entry->recv_ns != 0) {
+        entry->applied_ns = record->timestamp_ns;
+        add_sample(&apply, entry->applied_ns - entry->recv_ns);
+      }
+    } else if (record->stage == TRACE_PAYOUT_SENT) {
+      pending_cashout *entry = find_pending(record->player_id);
+      if (entry->recv_ns != 0 && entry->applied_ns != 0) {
+        add_sample(&payout, record->timestamp_ns - entry->applied_ns);
+        add_sample(&cashout, record->timestamp_ns - entry->recv_ns);
+      }
+      entry->recv_ns = 0;
+    }
+  }
+
+  printf("trace=%s | records=%zu | ticks=%zu | cashouts=%zu\n", argv[1],
+         record_count, fanout.count, cashout.count);
+  print_stage(&fanout);
+  print_stage(&sends);
+  print_stage(&apply);
+  print_stage(&payout);
+  print_stage(&cashout);
+
+  for (int i = 0; i < slowest_count; i++) {
+    printf("slow_tick | round=%u | tick=%u | fanout_us=%.2f | slowest=%s | "
+           "send_us=%.2f\n",
+           slowest_ticks[i].round_id, slowest_ticks[i].tick,
+           slowest_ticks[i].fanout_ns / 1000.0,
+           client_name(slowest_ticks[i].slowest_player),
+           slowest_ticks[i].slowest_ns / 1000.0);
+  }
+
+  // Clientes que mais vezes foram o envio mais lento do tick
+  qsort(clients, client_count, sizeof(client_stats), compare_clients);
+  for (size_t i = 0; i < client_count && i < (size_t)top; i++) {
+    printf("slow_client | %s | slowest_in=%lu ticks | sends=%lu | "
+           "avg_us=%.2f | max_us=%.2f\n",
+           client_name(clients[i].player_id), clients[i].slowest_ticks,
+           clients[i].sends, clients[i].total_ns / 1000.0 / clients[i].sends,
+           clients[i].max_ns / 1000.0);
+  }
+
+  free(fanout.values);
+  free(sends.values);
+  free(apply.values);
+  free(payout.values);
+  free(cashout.values);
+  free(slowest_ticks);
+  free(pending);
+  free(clients);
+  free(records);
+  return EXIT_SUCCESS;
+}
+
+void add_sample(stage_samples *samples, uint64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    samples->values =
+        realloc(samples->values, samples->capacity * sizeof(uint64_t));
+  }
+  samples->values[samples->count++] = value;
+}
+
+// Função para exibir os percentis de uma etapa
+void print_stage(stage_samples *samples) {
+  if (samples->count == 0) {
+    printf("%s | count=0\n", samples->name);
+    return;
+  }
+
+  qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+  printf("%s | count=%zu | p50_us=%.2f | p90_us=%.2f | p99_us=%.2f | "
+         "max_us=%.2f\n",
+         samples->name, samples->count,
+         samples->values[samples->count / 2] / 1000.0,
+         samples->values[(size_t)(samples->count * 0.9)] / 1000.0,
+         samples->values[(size_t)(samples->count * 0.99)] / 1000.0,
+         samples->values[samples->count - 1] / 1000.0);
+}
+
+// Função para obter o acumulado de um cliente, criando-o na primeira vez
+client_stats *find_client(int32_t player_id) {
+  for (size_t i = 0; i < client_count; i++) {
+    if (clients[i].player_id == player_id) {
+      return &clients[i];
+    }
+  }
+
+  clients = realloc(clients, (client_count + 1) * sizeof(client_stats));
+  memset(&clients[client_count], 0, sizeof(client_stats));
+  clients[client_count].player_id = player_id;
+  return &clients[client_count++];
+}
+
+// Função para obter o cashout em andamento de um jogador
+pending_cashout *find_pending(int32_t player_id) {
+  for (size_t i = 0; i < pending_count; i++) {
+    if (pending[i].player_id == player_id) {
+      return &pending[i];
+    }
+  }
+
+  pending = realloc(pending, (pending_count + 1) * sizeof(pending_cashout));
+  memset(&pending[pending_count], 0, sizeof(pending_cashout));
+  pending[pending_count].player_id = player_id;
+  return &pending[pending_count++];
+}
+
+// Mantém os ticks de maior fan-out, do mais lento para o mais rápido
+void keep_slowest_tick(const tick_summary *tick) {
+  int position = slowest_count;
+  while (position > 0 &&
+         slowest_ticks[position - 1].fanout_ns < tick->fanout_ns) {
+    position--;
+  }
+  if (position >= top) {
+    return;
+  }
+
+  int last = slowest_count < top ? slowest_count : top - 1;
+  memmove(&slowest_ticks[position + 1], &slowest_ticks[position],
+          (last - position) * sizeof(tick_summary));
+  slowest_ticks[position] = *tick;
+  if (slowest_count < top) {
+    slowest_count++;
+  }
+}
+
+// Envios para relays são marcados com o id negativo do relay
+const char *client_name(int32_t player_id) {
+  static char name[32];
+  if (player_id < 0) {
+    snprintf(name, sizeof(name), "relay=%d", -player_id);
+  } else {
+    snprintf(name, sizeof(name), "id=%d", player_id);
+  }
+  return name;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int compare_records(const void *a, const void *b) {
+  return compare_u64(&((const trace_record *)a)->timestamp_ns,
+                     &((const trace_record *)b)->timestamp_ns);
+}
+
+int compare_clients(const void *a, const void *b) {
+  const client_stats *x = a;
+  const client_stats *y = b;
+  if (x->slowest_ticks != y->slowest_ticks) {
+    return (x->slowest_ticks < y->slowest_ticks) -
+           (x->slowest_ticks > y->slowest_ticks);
+  }
+  return (x->max_ns < y->max_ns) - (x->max_ns > y->max_ns);
+}
+
+// Função para exibir erros genéricos e finalizar a execução do programa sem
+// tratamentos
+void endWithErrorMessage(const char *message) {
+  perror(message);
+  exit(EXIT_FAILURE);
+}